@@ -0,0 +1,248 @@
+// Measures latency, staleness and reconnect time of updates sent through a
+// `fault_proxy` under scripted impairment profiles, over TCP (`server` to
+// `client`) and UDP multicast.
+//
+// Usage: ircom_bench_degraded_links [PROFILE...]
+//
+// Faults are seeded, such that every run injects the same ones.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fault_proxy.h"
+#include "ircom/ircom.h"
+#include "ircom/multicast.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+using namespace std::chrono_literals;
+
+const std::uint16_t ORIGIN_PORT = 40101;
+const std::uint16_t PROXY_PORT = 40102;
+const std::string ORIGIN_GROUP = "239.255.40.11";
+const std::string PROXY_GROUP = "239.255.40.12";
+const std::uint16_t ORIGIN_MULTICAST_PORT = 40111;
+const std::uint16_t PROXY_MULTICAST_PORT = 40112;
+
+const std::chrono::milliseconds SEND_INTERVAL{5};
+const std::chrono::microseconds SAMPLE_INTERVAL{250};
+const std::chrono::seconds CONNECT_TIMEOUT{10};
+const std::uint32_t SEED = 42;
+
+const ircom::bench::impairment WIFI = {
+    .delay = 2ms,
+    .jitter = 8ms,
+    .loss = 0.02,
+};
+
+struct step {
+  std::chrono::milliseconds duration;
+  ircom::bench::impairment imp;
+  // Drops every connection at the start of the step.
+  bool disconnect = false;
+};
+
+struct profile {
+  const char* name;
+  std::vector<step> steps;
+  // Disconnects do not apply to multicast.
+  bool multicast = true;
+};
+
+const std::vector<profile> PROFILES = {
+    {"clean", {{.duration = 3s}}},
+    {"wifi", {{.duration = 3s, .imp = WIFI}}},
+    {"congested",
+     {{.duration = 3s,
+       .imp = {.delay = 1ms, .bandwidth_bytes_per_sec = 6000}}}},
+    {"corrupted", {{.duration = 3s, .imp = {.corruption = 1e-4}}}},
+    {"flaky",
+     {{.duration = 1s, .imp = WIFI},
+      {.duration = 2s, .imp = WIFI, .disconnect = true},
+      {.duration = 2s, .imp = WIFI, .disconnect = true}},
+     false},
+};
+
+double now_ns() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double> samples, double p) {
+  if (samples.empty()) return 0;
+  std::size_t idx = static_cast<std::size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+struct results {
+  std::vector<double> latencies_ms;
+  std::vector<double> staleness_ms;
+  std::vector<double> reconnects_ms;
+  int disconnects = 0;
+  int corrupted = 0;
+  int observed = 0;
+  int sent = 0;
+};
+
+// Sends numbered updates, marked such that corruption is detected, and samples
+// the receiving side while running the profile's steps.
+results run_steps(
+    const profile& prof, ircom::bench::fault_proxy& proxy,
+    const std::function<void(const ircom::packet::payload&)>& send,
+    const std::function<ircom::packet::payload()>& latest) {
+  results res;
+
+  // Waits for the first update to get through, i.e. connected.
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+  for (double x = -1; latest().x != x;) {
+    if (std::chrono::steady_clock::now() > deadline) return res;
+    send({.x = x, .y = 2 * x, .t = now_ns()});
+    std::this_thread::sleep_for(SEND_INTERVAL);
+  }
+
+  std::atomic<bool> done = false;
+  std::thread sender([&]() {
+    for (double x = 0; !done; ++x) {
+      send({.x = x, .y = 2 * x, .t = now_ns()});
+      ++res.sent;
+      std::this_thread::sleep_for(SEND_INTERVAL);
+    }
+  });
+
+  std::atomic<double> disconnected_at = 0;
+  std::thread sampler([&]() {
+    double last_x = -1;
+    while (!done) {
+      ircom::packet::payload pl = latest();
+      double now = now_ns();
+      if (pl.x != last_x) {
+        last_x = pl.x;
+        ++res.observed;
+        if (pl.y != 2 * pl.x) ++res.corrupted;
+        res.latencies_ms.push_back((now - pl.t) / 1e6);
+
+        double since = disconnected_at;
+        if (since > 0 && pl.t > since) {
+          res.reconnects_ms.push_back((now - since) / 1e6);
+          disconnected_at = 0;
+        }
+      }
+      res.staleness_ms.push_back((now - pl.t) / 1e6);
+      std::this_thread::sleep_for(SAMPLE_INTERVAL);
+    }
+  });
+
+  for (const step& s : prof.steps) {
+    proxy.set_impairment(s.imp);
+    if (s.disconnect) {
+      disconnected_at = now_ns();
+      ++res.disconnects;
+      proxy.disconnect_all();
+    }
+    std::this_thread::sleep_for(s.duration);
+  }
+
+  done = true;
+  sender.join();
+  sampler.join();
+  return res;
+}
+
+void report(const profile& prof, const char* transport, const results& res) {
+  if (res.sent == 0) {
+    std::printf("%-10s %-5s never connected\n", prof.name, transport);
+    return;
+  }
+
+  double reconnect_mean = 0;
+  for (double ms : res.reconnects_ms) reconnect_mean += ms;
+  if (!res.reconnects_ms.empty()) reconnect_mean /= res.reconnects_ms.size();
+
+  std::printf(
+      "%-10s %-5s %7.2f %8.2f %7.2f %8.2f %6zu/%-3d %8.1f %6.1f%% %5d\n",
+      prof.name, transport, percentile(res.latencies_ms, 0.5),
+      percentile(res.latencies_ms, 0.99), percentile(res.staleness_ms, 0.5),
+      percentile(res.staleness_ms, 0.99), res.reconnects_ms.size(),
+      res.disconnects, reconnect_mean, 100.0 * res.observed / res.sent,
+      res.corrupted);
+}
+
+void run_tcp(const profile& prof) {
+  ircom::server origin("ircom-bench-origin", {.port = ORIGIN_PORT});
+  ircom::bench::fault_proxy proxy(SEED);
+  proxy.forward_tcp(PROXY_PORT,
+                    boost::asio::ip::tcp::endpoint(
+                        boost::asio::ip::address_v4::loopback(), ORIGIN_PORT));
+  proxy.start();
+  ircom::discovery::publisher proxy_publisher(
+      "ircom-bench", ircom::discovery::DISCOVERY_SERVICE_TYPE, PROXY_PORT);
+  proxy_publisher.publish();
+  ircom::client receiver("ircom-bench", {.port = PROXY_PORT});
+
+  results res = run_steps(
+      prof, proxy,
+      [&](const ircom::packet::payload& pl) { origin.send_update(pl); },
+      [&]() { return receiver.latest_update(); });
+  report(prof, "tcp", res);
+}
+
+void run_multicast(const profile& prof) {
+  ircom::multicast_publisher origin(
+      "ircom-bench-mcast-origin",
+      {.group = ORIGIN_GROUP, .port = ORIGIN_MULTICAST_PORT});
+  ircom::bench::fault_proxy proxy(SEED);
+  proxy.forward_udp(
+      boost::asio::ip::udp::endpoint(
+          boost::asio::ip::make_address(ORIGIN_GROUP), ORIGIN_MULTICAST_PORT),
+      boost::asio::ip::udp::endpoint(boost::asio::ip::make_address(PROXY_GROUP),
+                                     PROXY_MULTICAST_PORT));
+  proxy.start();
+  ircom::discovery::publisher proxy_publisher(
+      "ircom-bench-mcast", ircom::discovery::MULTICAST_SERVICE_TYPE,
+      PROXY_MULTICAST_PORT, {ircom::MULTICAST_TXT_GROUP_KEY + PROXY_GROUP});
+  proxy_publisher.publish();
+  ircom::multicast_subscriber receiver("ircom-bench-mcast",
+                                       {.port = PROXY_MULTICAST_PORT});
+
+  results res = run_steps(
+      prof, proxy,
+      [&](const ircom::packet::payload& pl) { origin.send_update(pl); },
+      [&]() { return receiver.latest_update(); });
+  report(prof, "udp", res);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::vector<std::string> selected(argv + 1, argv + argc);
+  // Injected disconnects are logged as errors.
+  spdlog::set_level(spdlog::level::critical);
+
+  std::printf("%-10s %-5s %7s %8s %7s %8s %10s %8s %7s %5s\n", "profile",
+              "link", "lat p50", "lat p99", "age p50", "age p99", "reconnects",
+              "reconn", "seen", "bad");
+  std::printf("%-10s %-5s %7s %8s %7s %8s %10s %8s %7s %5s\n", "", "", "(ms)",
+              "(ms)", "(ms)", "(ms)", "", "(ms)", "", "");
+  for (const profile& prof : PROFILES) {
+    if (!selected.empty() &&
+        std::find(selected.begin(), selected.end(), prof.name) ==
+            selected.end())
+      continue;
+
+    run_tcp(prof);
+    if (prof.multicast) run_multicast(prof);
+  }
+}
@@ -0,0 +1,315 @@
+#include "fault_proxy.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "spdlog/spdlog.h"
+
+namespace ircom::bench {
+
+namespace {
+
+const std::size_t READ_CHUNK_SIZE = 16 * 1024;
+// Like a router queue. Beyond this, TCP data is left in the sender's socket
+// and datagrams are dropped.
+const std::size_t MAX_BUFFERED_BYTES = 64 * 1024;
+// Typical TCP payload per segment, the unit in which loss applies.
+const std::size_t SEGMENT_SIZE = 1448;
+const std::size_t MAX_DATAGRAM_SIZE = 64 * 1024;
+
+}  // namespace
+
+fault_proxy::fault_proxy(std::uint32_t seed) : rng_(seed) {}
+
+fault_proxy::~fault_proxy() {
+  if (!io_ctx_thread_.joinable()) return;
+
+  boost::asio::post(io_ctx_, [&]() {
+    boost::system::error_code ec;
+    for (const std::shared_ptr<boost::asio::ip::tcp::acceptor>& acceptor :
+         acceptors_)
+      acceptor->close(ec);
+    for (const std::shared_ptr<boost::asio::ip::udp::socket>& sock :
+         udp_sockets_)
+      sock->close(ec);
+    for (const std::weak_ptr<connection>& weak_conn : connections_) {
+      if (std::shared_ptr<connection> conn = weak_conn.lock()) close(*conn);
+    }
+    // Datagrams still waiting for their release are dropped.
+    io_ctx_.stop();
+  });
+  io_ctx_thread_.join();
+}
+
+void fault_proxy::forward_tcp(std::uint16_t listen_port,
+                              const boost::asio::ip::tcp::endpoint& upstream) {
+  acceptors_.push_back(std::make_shared<boost::asio::ip::tcp::acceptor>(
+      io_ctx_,
+      boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                     listen_port)));
+  upstreams_.push_back(upstream);
+}
+
+void fault_proxy::forward_udp(const boost::asio::ip::udp::endpoint& listen,
+                              const boost::asio::ip::udp::endpoint& target) {
+  std::shared_ptr<boost::asio::ip::udp::socket> sock =
+      std::make_shared<boost::asio::ip::udp::socket>(io_ctx_);
+  sock->open(listen.protocol());
+  sock->set_option(boost::asio::ip::udp::socket::reuse_address(true));
+  if (listen.address().is_multicast()) {
+    sock->bind(
+        boost::asio::ip::udp::endpoint(listen.protocol(), listen.port()));
+    sock->set_option(boost::asio::ip::multicast::join_group(listen.address()));
+  } else {
+    sock->bind(listen);
+  }
+  if (target.address().is_multicast()) {
+    sock->set_option(boost::asio::ip::multicast::hops(1));
+    sock->set_option(boost::asio::ip::multicast::enable_loopback(true));
+  }
+
+  udp_sockets_.push_back(std::move(sock));
+  udp_targets_.push_back(target);
+}
+
+void fault_proxy::start() {
+  for (std::size_t i = 0; i < acceptors_.size(); ++i) {
+    boost::asio::co_spawn(io_ctx_, accept_loop(acceptors_[i], upstreams_[i]),
+                          boost::asio::detached);
+  }
+  for (std::size_t i = 0; i < udp_sockets_.size(); ++i) {
+    boost::asio::co_spawn(io_ctx_,
+                          datagram_loop(udp_sockets_[i], udp_targets_[i]),
+                          boost::asio::detached);
+  }
+  io_ctx_thread_ = std::thread([this]() { io_ctx_.run(); });
+}
+
+void fault_proxy::set_impairment(const impairment& imp) {
+  boost::asio::post(io_ctx_, [this, imp]() { imp_ = imp; });
+}
+
+void fault_proxy::disconnect_all() {
+  boost::asio::post(io_ctx_, [this]() {
+    for (const std::weak_ptr<connection>& weak_conn : connections_) {
+      if (std::shared_ptr<connection> conn = weak_conn.lock()) close(*conn);
+    }
+    connections_.clear();
+  });
+}
+
+boost::asio::awaitable<void> fault_proxy::accept_loop(
+    std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor,
+    boost::asio::ip::tcp::endpoint upstream) {
+  try {
+    while (true) {
+      std::shared_ptr<connection> conn = std::make_shared<connection>(io_ctx_);
+      co_await acceptor->async_accept(conn->downstream,
+                                      boost::asio::use_awaitable);
+
+      try {
+        co_await conn->upstream.async_connect(upstream,
+                                              boost::asio::use_awaitable);
+      } catch (const boost::system::system_error& err) {
+        spdlog::warn("Proxy failed to reach upstream: {}", err.what());
+        close(*conn);
+        continue;
+      }
+
+      std::erase_if(connections_, [](const std::weak_ptr<connection>& c) {
+        return c.expired();
+      });
+      connections_.push_back(conn);
+      boost::asio::co_spawn(io_ctx_, forward_connection(std::move(conn)),
+                            boost::asio::detached);
+    }
+  } catch (const boost::system::system_error&) {
+    // Closed by the destructor.
+  }
+}
+
+boost::asio::awaitable<void> fault_proxy::forward_connection(
+    std::shared_ptr<connection> conn) {
+  for (boost::asio::ip::tcp::socket* sock :
+       {&conn->downstream, &conn->upstream})
+    sock->set_option(boost::asio::ip::tcp::no_delay(true));
+
+  boost::asio::co_spawn(io_ctx_,
+                        read_pipe(conn, conn->downstream, conn->to_upstream),
+                        boost::asio::detached);
+  boost::asio::co_spawn(io_ctx_,
+                        write_pipe(conn, conn->upstream, conn->to_upstream),
+                        boost::asio::detached);
+  boost::asio::co_spawn(io_ctx_,
+                        read_pipe(conn, conn->upstream, conn->to_downstream),
+                        boost::asio::detached);
+  boost::asio::co_spawn(io_ctx_,
+                        write_pipe(conn, conn->downstream, conn->to_downstream),
+                        boost::asio::detached);
+  co_return;
+}
+
+boost::asio::awaitable<void> fault_proxy::read_pipe(
+    std::shared_ptr<connection> conn, boost::asio::ip::tcp::socket& from,
+    pipe& p) {
+  std::vector<std::uint8_t> buf(READ_CHUNK_SIZE);
+  try {
+    while (true) {
+      while (p.buffered >= MAX_BUFFERED_BYTES) {
+        // Woken up by `write_pipe`.
+        p.reader_wake.expires_at(std::chrono::steady_clock::time_point::max());
+        boost::system::error_code ec;
+        co_await p.reader_wake.async_wait(
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (!from.is_open()) co_return;
+      }
+
+      std::size_t size = co_await from.async_read_some(
+          boost::asio::buffer(buf), boost::asio::use_awaitable);
+      chunk c = {.data = std::vector<std::uint8_t>(buf.begin(),
+                                                   buf.begin() + size)};
+      corrupt(c.data);
+
+      std::chrono::steady_clock::time_point release_at =
+          std::chrono::steady_clock::now() + sample_delay();
+      double segments = std::ceil(static_cast<double>(size) / SEGMENT_SIZE);
+      std::bernoulli_distribution is_lost(
+          1 - std::pow(1 - imp_.loss, segments));
+      if (is_lost(rng_)) release_at += imp_.retransmit_timeout;
+      release_at = std::max(release_at, p.last_release_at);
+      if (imp_.bandwidth_bytes_per_sec > 0) {
+        release_at = std::max(release_at, p.link_free_at) +
+                     std::chrono::duration_cast<
+                         std::chrono::steady_clock::duration>(
+                         std::chrono::duration<double>(
+                             size / imp_.bandwidth_bytes_per_sec));
+        p.link_free_at = release_at;
+      }
+      p.last_release_at = release_at;
+      c.release_at = release_at;
+
+      p.buffered += size;
+      p.chunks.push_back(std::move(c));
+      p.writer_wake.cancel();
+    }
+  } catch (const boost::system::system_error&) {
+    close(*conn);
+  }
+}
+
+boost::asio::awaitable<void> fault_proxy::write_pipe(
+    std::shared_ptr<connection> conn, boost::asio::ip::tcp::socket& to,
+    pipe& p) {
+  try {
+    while (to.is_open()) {
+      if (p.chunks.empty() ||
+          p.chunks.front().release_at > std::chrono::steady_clock::now()) {
+        // Woken up by `read_pipe` once a chunk is available.
+        p.writer_wake.expires_at(
+            p.chunks.empty() ? std::chrono::steady_clock::time_point::max()
+                             : p.chunks.front().release_at);
+        boost::system::error_code ec;
+        co_await p.writer_wake.async_wait(
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        continue;
+      }
+
+      chunk c = std::move(p.chunks.front());
+      p.chunks.pop_front();
+      co_await boost::asio::async_write(to, boost::asio::buffer(c.data),
+                                        boost::asio::use_awaitable);
+      p.buffered -= c.data.size();
+      p.reader_wake.cancel();
+    }
+  } catch (const boost::system::system_error&) {
+    close(*conn);
+  }
+}
+
+boost::asio::awaitable<void> fault_proxy::datagram_loop(
+    std::shared_ptr<boost::asio::ip::udp::socket> sock,
+    boost::asio::ip::udp::endpoint target) {
+  std::vector<std::uint8_t> buf(MAX_DATAGRAM_SIZE);
+  try {
+    while (true) {
+      boost::asio::ip::udp::endpoint sender;
+      std::size_t size = co_await sock->async_receive_from(
+          boost::asio::buffer(buf), sender, boost::asio::use_awaitable);
+
+      std::bernoulli_distribution is_lost(imp_.loss);
+      if (is_lost(rng_)) continue;
+
+      chunk dgram = {.data = std::vector<std::uint8_t>(buf.begin(),
+                                                       buf.begin() + size)};
+      corrupt(dgram.data);
+      dgram.release_at = std::chrono::steady_clock::now() + sample_delay();
+      if (imp_.bandwidth_bytes_per_sec > 0) {
+        // Tail drop once the queue in front of the capped link is full.
+        std::chrono::duration<double> queued =
+            udp_link_free_at_ - std::chrono::steady_clock::now();
+        if (queued.count() * imp_.bandwidth_bytes_per_sec >
+            MAX_BUFFERED_BYTES)
+          continue;
+
+        dgram.release_at =
+            std::max(dgram.release_at, udp_link_free_at_) +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(size /
+                                              imp_.bandwidth_bytes_per_sec));
+        udp_link_free_at_ = dgram.release_at;
+      }
+
+      boost::asio::co_spawn(io_ctx_,
+                            send_datagram_later(sock, target, std::move(dgram)),
+                            boost::asio::detached);
+    }
+  } catch (const boost::system::system_error&) {
+    // Closed by the destructor.
+  }
+}
+
+boost::asio::awaitable<void> fault_proxy::send_datagram_later(
+    std::shared_ptr<boost::asio::ip::udp::socket> sock,
+    boost::asio::ip::udp::endpoint target, chunk dgram) {
+  boost::asio::steady_timer timer(io_ctx_, dgram.release_at);
+  boost::system::error_code ec;
+  co_await timer.async_wait(
+      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+  if (!sock->is_open()) co_return;
+
+  sock->send_to(boost::asio::buffer(dgram.data), target, 0, ec);
+}
+
+void fault_proxy::corrupt(std::vector<std::uint8_t>& data) {
+  if (imp_.corruption <= 0) return;
+
+  std::binomial_distribution<std::size_t> corrupted_count(data.size(),
+                                                          imp_.corruption);
+  std::uniform_int_distribution<std::size_t> position(0, data.size() - 1);
+  std::uniform_int_distribution<int> bit(0, 7);
+  for (std::size_t n = corrupted_count(rng_); n > 0; --n)
+    data[position(rng_)] ^= static_cast<std::uint8_t>(1 << bit(rng_));
+}
+
+std::chrono::steady_clock::duration fault_proxy::sample_delay() {
+  std::uniform_int_distribution<std::chrono::microseconds::rep> jitter(
+      0, imp_.jitter.count());
+  return imp_.delay + std::chrono::microseconds(jitter(rng_));
+}
+
+void fault_proxy::close(connection& conn) {
+  boost::system::error_code ec;
+  for (boost::asio::ip::tcp::socket* sock :
+       {&conn.downstream, &conn.upstream}) {
+    if (!sock->is_open()) continue;
+    // Reset instead of a graceful close, like a link going down.
+    sock->set_option(boost::asio::socket_base::linger(true, 0), ec);
+    sock->close(ec);
+  }
+  for (pipe* p : {&conn.to_upstream, &conn.to_downstream}) {
+    p->reader_wake.cancel();
+    p->writer_wake.cancel();
+  }
+}
+
+}  // namespace ircom::bench
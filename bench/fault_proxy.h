@@ -0,0 +1,140 @@
+#ifndef IRCOM_BENCH_FAULT_PROXY_H_
+#define IRCOM_BENCH_FAULT_PROXY_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Before Boost.Asio 1.79.0, "boost/asio/awaitable.hpp" does not include
+// <utility> causing `std::exchange` to be missing. Fixed by commit
+// 71964b22c7fade69cc4caa1c869a868e3a32cc97. Backported to here.
+// clang-format off
+#include <utility>
+#include "boost/asio.hpp"
+// clang-format on
+
+namespace ircom::bench {
+
+// Degradation applied to forwarded traffic, in both directions.
+struct impairment {
+  // One-way delay added to everything.
+  std::chrono::microseconds delay{0};
+  // Additional delay picked uniformly in [0, jitter]. TCP data is never
+  // reordered, datagrams may be.
+  std::chrono::microseconds jitter{0};
+  // Zero means unlimited.
+  double bandwidth_bytes_per_sec = 0;
+  // Probability for a datagram to be dropped. A stream cannot lose data, so a
+  // lost TCP segment stalls the stream for `retransmit_timeout` instead.
+  double loss = 0;
+  std::chrono::microseconds retransmit_timeout{200000};
+  // Probability for each forwarded byte to get a bit flipped.
+  double corruption = 0;
+};
+
+// Loopback proxy injecting faults between an ircom peer and its remote, e.g.
+// to reproduce a lossy Wi-Fi link. Runs its own IO context thread.
+class fault_proxy {
+ public:
+  // A fixed seed makes the injected faults reproducible.
+  explicit fault_proxy(std::uint32_t seed = 0);
+  ~fault_proxy();
+
+  fault_proxy(const fault_proxy&) = delete;
+  fault_proxy& operator=(const fault_proxy&) = delete;
+
+  // The following MUST BE called before `start`.
+
+  // Forwards connections accepted on `listen_port` to `upstream`.
+  void forward_tcp(std::uint16_t listen_port,
+                   const boost::asio::ip::tcp::endpoint& upstream);
+  // Forwards datagrams received on `listen` to `target`. A multicast
+  // `listen` address is joined.
+  void forward_udp(const boost::asio::ip::udp::endpoint& listen,
+                   const boost::asio::ip::udp::endpoint& target);
+
+  void start();
+
+  // The following are thread-safe.
+
+  // Applies to data received from now on.
+  void set_impairment(const impairment& imp);
+  // Closes every forwarded connection, dropping the data in flight.
+  void disconnect_all();
+
+ private:
+  struct chunk {
+    std::vector<std::uint8_t> data;
+    std::chrono::steady_clock::time_point release_at;
+  };
+
+  // One direction of a forwarded connection.
+  struct pipe {
+    explicit pipe(boost::asio::io_context& io_ctx)
+        : reader_wake(io_ctx), writer_wake(io_ctx) {}
+
+    std::deque<chunk> chunks;
+    std::size_t buffered = 0;
+    // Keeps data in order even when jitter decreases.
+    std::chrono::steady_clock::time_point last_release_at;
+    std::chrono::steady_clock::time_point link_free_at;
+    boost::asio::steady_timer reader_wake;
+    boost::asio::steady_timer writer_wake;
+  };
+
+  struct connection {
+    explicit connection(boost::asio::io_context& io_ctx)
+        : downstream(io_ctx), upstream(io_ctx), to_upstream(io_ctx),
+          to_downstream(io_ctx) {}
+
+    boost::asio::ip::tcp::socket downstream;
+    boost::asio::ip::tcp::socket upstream;
+    pipe to_upstream;
+    pipe to_downstream;
+  };
+
+  boost::asio::awaitable<void> accept_loop(
+      std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor,
+      boost::asio::ip::tcp::endpoint upstream);
+  boost::asio::awaitable<void> forward_connection(
+      std::shared_ptr<connection> conn);
+  boost::asio::awaitable<void> read_pipe(std::shared_ptr<connection> conn,
+                                         boost::asio::ip::tcp::socket& from,
+                                         pipe& p);
+  boost::asio::awaitable<void> write_pipe(std::shared_ptr<connection> conn,
+                                          boost::asio::ip::tcp::socket& to,
+                                          pipe& p);
+  boost::asio::awaitable<void> datagram_loop(
+      std::shared_ptr<boost::asio::ip::udp::socket> sock,
+      boost::asio::ip::udp::endpoint target);
+  boost::asio::awaitable<void> send_datagram_later(
+      std::shared_ptr<boost::asio::ip::udp::socket> sock,
+      boost::asio::ip::udp::endpoint target, chunk dgram);
+
+  void corrupt(std::vector<std::uint8_t>& data);
+  std::chrono::steady_clock::duration sample_delay();
+  void close(connection& conn);
+
+  boost::asio::io_context io_ctx_;
+  std::thread io_ctx_thread_;
+
+  impairment imp_;
+  std::mt19937 rng_;
+
+  std::vector<std::shared_ptr<boost::asio::ip::tcp::acceptor>> acceptors_;
+  std::vector<boost::asio::ip::tcp::endpoint> upstreams_;
+  std::vector<std::shared_ptr<boost::asio::ip::udp::socket>> udp_sockets_;
+  std::vector<boost::asio::ip::udp::endpoint> udp_targets_;
+  std::chrono::steady_clock::time_point udp_link_free_at_;
+  std::list<std::weak_ptr<connection>> connections_;
+};
+
+}  // namespace ircom::bench
+
+#endif
@@ -0,0 +1,149 @@
+// Standalone fault-injection proxy, e.g. to degrade the link between two ircom
+// processes on the same host.
+//
+// Usage: ircom_fault_proxy [options]
+//   --tcp LISTEN_PORT UPSTREAM_ADDR:PORT
+//   --udp LISTEN_ADDR:PORT TARGET_ADDR:PORT
+//   --publish NAME            announce the TCP listen port as service NAME
+//   --publish-multicast NAME  announce the UDP target group as service NAME
+//   --delay-ms N --jitter-ms N --bandwidth BYTES_PER_SEC --loss P
+//   --rto-ms N --corrupt P --disconnect-every-ms N --seed N
+//
+// Example, putting a lossy link in front of a server running on port 40101:
+//   ircom_fault_proxy --tcp 40001 127.0.0.1:40101 --publish robot --loss 0.01
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fault_proxy.h"
+#include "ircom/discovery.h"
+#include "ircom/multicast.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+template <typename Endpoint>
+Endpoint parse_endpoint(const std::string& str) {
+  std::size_t sep = str.rfind(':');
+  if (sep == std::string::npos)
+    throw std::invalid_argument("Expected ADDR:PORT, got " + str);
+  return Endpoint(boost::asio::ip::make_address(str.substr(0, sep)),
+                  static_cast<std::uint16_t>(std::stoi(str.substr(sep + 1))));
+}
+
+std::chrono::microseconds parse_ms(const char* str) {
+  return std::chrono::microseconds(
+      static_cast<std::int64_t>(std::atof(str) * 1000));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ircom::bench::impairment imp;
+  std::uint32_t seed = 0;
+  std::chrono::milliseconds disconnect_every{0};
+  std::optional<std::uint16_t> tcp_listen_port;
+  boost::asio::ip::tcp::endpoint tcp_upstream;
+  std::optional<boost::asio::ip::udp::endpoint> udp_listen;
+  boost::asio::ip::udp::endpoint udp_target;
+  std::string service_name;
+  std::string multicast_service_name;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      auto next = [&]() -> const char* {
+        if (++i >= argc) throw std::invalid_argument("Missing value: " + arg);
+        return argv[i];
+      };
+
+      if (arg == "--tcp") {
+        tcp_listen_port = static_cast<std::uint16_t>(std::atoi(next()));
+        tcp_upstream = parse_endpoint<boost::asio::ip::tcp::endpoint>(next());
+      } else if (arg == "--udp") {
+        udp_listen = parse_endpoint<boost::asio::ip::udp::endpoint>(next());
+        udp_target = parse_endpoint<boost::asio::ip::udp::endpoint>(next());
+      } else if (arg == "--publish") {
+        service_name = next();
+      } else if (arg == "--publish-multicast") {
+        multicast_service_name = next();
+      } else if (arg == "--delay-ms") {
+        imp.delay = parse_ms(next());
+      } else if (arg == "--jitter-ms") {
+        imp.jitter = parse_ms(next());
+      } else if (arg == "--bandwidth") {
+        imp.bandwidth_bytes_per_sec = std::atof(next());
+      } else if (arg == "--loss") {
+        imp.loss = std::atof(next());
+      } else if (arg == "--rto-ms") {
+        imp.retransmit_timeout = parse_ms(next());
+      } else if (arg == "--corrupt") {
+        imp.corruption = std::atof(next());
+      } else if (arg == "--disconnect-every-ms") {
+        disconnect_every = std::chrono::milliseconds(std::atoi(next()));
+      } else if (arg == "--seed") {
+        seed = static_cast<std::uint32_t>(std::atoi(next()));
+      } else {
+        throw std::invalid_argument("Unknown option: " + arg);
+      }
+    }
+    if (!tcp_listen_port && !udp_listen)
+      throw std::invalid_argument("Nothing to forward, use --tcp or --udp");
+  } catch (const std::exception& err) {
+    std::fprintf(stderr, "%s\n", err.what());
+    return EXIT_FAILURE;
+  }
+
+  ircom::bench::fault_proxy proxy(seed);
+  if (tcp_listen_port) proxy.forward_tcp(*tcp_listen_port, tcp_upstream);
+  if (udp_listen) proxy.forward_udp(*udp_listen, udp_target);
+  proxy.set_impairment(imp);
+  proxy.start();
+
+  std::unique_ptr<ircom::discovery::publisher> publisher;
+  if (!service_name.empty() && tcp_listen_port) {
+    publisher = std::make_unique<ircom::discovery::publisher>(
+        service_name.c_str(), ircom::discovery::DISCOVERY_SERVICE_TYPE,
+        *tcp_listen_port);
+    publisher->publish();
+  }
+  std::unique_ptr<ircom::discovery::publisher> multicast_publisher;
+  if (!multicast_service_name.empty() && udp_listen) {
+    multicast_publisher = std::make_unique<ircom::discovery::publisher>(
+        multicast_service_name.c_str(),
+        ircom::discovery::MULTICAST_SERVICE_TYPE, udp_target.port(),
+        std::vector<std::string>{ircom::MULTICAST_TXT_GROUP_KEY +
+                                 udp_target.address().to_string()});
+    multicast_publisher->publish();
+  }
+  spdlog::info("Proxy running, interrupt to stop");
+
+  boost::asio::io_context io_ctx;
+  boost::asio::signal_set signals(io_ctx, SIGINT, SIGTERM);
+  boost::asio::steady_timer disconnect_timer(io_ctx);
+  signals.async_wait([&](const boost::system::error_code&, int) {
+    disconnect_timer.cancel();
+  });
+  std::function<void(const boost::system::error_code&)> on_timer =
+      [&](const boost::system::error_code& ec) {
+        if (ec) return;
+        spdlog::info("Disconnecting every forwarded connection");
+        proxy.disconnect_all();
+        disconnect_timer.expires_after(disconnect_every);
+        disconnect_timer.async_wait(on_timer);
+      };
+  if (disconnect_every.count() > 0) {
+    disconnect_timer.expires_after(disconnect_every);
+    disconnect_timer.async_wait(on_timer);
+  }
+  io_ctx.run();
+}
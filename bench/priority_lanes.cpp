@@ -0,0 +1,171 @@
+// Measures the latency of urgent updates while the bulk lane is saturated.
+//
+// Usage: ircom_bench_priority_lanes [--fifo] [--message]
+//
+// With `--fifo`, bulk traffic is sent over the urgent lane as well, which
+// reproduces the single-queue behaviour for comparison.
+//
+// With `--message`, the bulk load is one large message instead, read by a peer
+// throttled to `SLOW_READ_BYTES_PER_SEC` as over a congested link. The send
+// buffer then fills up, which is where urgent frames would queue.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "ircom/ircom.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+const int URGENT_COUNT = 1000;
+const int BULK_PER_URGENT = 150;
+const std::chrono::milliseconds URGENT_INTERVAL{2};
+const double URGENT_MARK = 1.0;
+
+// Of `--message`.
+const std::size_t MESSAGE_SIZE = 8 * 1024 * 1024;
+const int MESSAGE_URGENT_COUNT = 60;
+const std::chrono::milliseconds MESSAGE_URGENT_INTERVAL{50};
+const double SLOW_READ_BYTES_PER_SEC = 2e6;
+const std::size_t SLOW_READ_SIZE = 4096;
+
+double now_ns() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double>& samples, double p) {
+  if (samples.empty()) return 0;
+  std::size_t idx = static_cast<std::size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+// Size of the complete frame at the start of `data`, or 0 if incomplete.
+std::size_t frame_size(const std::vector<std::uint8_t>& data) {
+  const std::size_t prefix_size =
+      ircom::packet::HEADER_SIZE + ircom::packet::FRAME_TYPE_SIZE;
+  if (data.size() < prefix_size) return 0;
+
+  std::size_t size;
+  if (data[ircom::packet::HEADER_SIZE] == ircom::packet::FRAME_UPDATE) {
+    size = ircom::packet::UPDATE_FRAME_SIZE;
+  } else {
+    if (data.size() < prefix_size + ircom::packet::CHUNK_HEADER_SIZE) return 0;
+    ircom::packet::chunk_header header;
+    header.deserialize(data.data() + prefix_size);
+    size = prefix_size + ircom::packet::CHUNK_HEADER_SIZE + header.size +
+           ircom::packet::FOOTER_SIZE;
+  }
+  return data.size() >= size ? size : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool fifo = false;
+  bool message = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--fifo") == 0) {
+      fifo = true;
+    } else if (std::strcmp(argv[i], "--message") == 0) {
+      message = true;
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  spdlog::set_level(spdlog::level::err);
+  const int urgent_count = message ? MESSAGE_URGENT_COUNT : URGENT_COUNT;
+
+  boost::asio::io_context io_ctx;
+  boost::asio::ip::tcp::acceptor acceptor(
+      io_ctx, boost::asio::ip::tcp::endpoint(
+                  boost::asio::ip::address_v4::loopback(), 0));
+  ircom::link_group group(io_ctx);
+  std::shared_ptr<ircom::update_keeper> tx = group.make_link();
+  boost::asio::ip::tcp::socket rx(io_ctx);
+  tx->socket().connect(acceptor.local_endpoint());
+  acceptor.accept(rx);
+  boost::asio::co_spawn(io_ctx, group.serve(tx), boost::asio::detached);
+
+  auto work = boost::asio::make_work_guard(io_ctx);
+  std::thread io_thread([&]() { io_ctx.run(); });
+
+  std::vector<double> latencies_us;
+  latencies_us.reserve(urgent_count);
+  std::thread rx_thread([&]() {
+    const std::size_t body_offset = ircom::packet::HEADER_SIZE +
+                                    ircom::packet::FRAME_TYPE_SIZE +
+                                    ircom::packet::SEQUENCE_SIZE;
+    std::vector<std::uint8_t> data;
+    std::vector<std::uint8_t> buf(message ? SLOW_READ_SIZE : 64 * 1024);
+    double read_bytes = 0;
+    double start_ns = now_ns();
+    boost::system::error_code ec;
+    while (true) {
+      std::size_t size = rx.read_some(boost::asio::buffer(buf), ec);
+      if (ec) break;
+      data.insert(data.end(), buf.begin(), buf.begin() + size);
+      for (std::size_t frame = frame_size(data); frame > 0;
+           frame = frame_size(data)) {
+        if (data[ircom::packet::HEADER_SIZE] == ircom::packet::FRAME_UPDATE) {
+          ircom::packet::payload pl;
+          pl.deserialize(data.data() + body_offset);
+          if (pl.x == URGENT_MARK)
+            latencies_us.push_back((now_ns() - pl.t) / 1e3);
+        }
+        data.erase(data.begin(), data.begin() + frame);
+      }
+
+      if (message) {
+        read_bytes += size;
+        std::this_thread::sleep_for(std::chrono::duration<double, std::nano>(
+            start_ns + read_bytes / SLOW_READ_BYTES_PER_SEC * 1e9 - now_ns()));
+      }
+    }
+  });
+
+  ircom::lane bulk_lane = fifo ? ircom::lane::urgent : ircom::lane::bulk;
+  if (message) {
+    auto msg = std::make_shared<std::vector<std::uint8_t>>(MESSAGE_SIZE);
+    group.send_message(boost::asio::buffer(*msg), msg);
+    for (int i = 0; i < MESSAGE_URGENT_COUNT; ++i) {
+      group.send_update({.x = URGENT_MARK, .y = 0, .t = now_ns()});
+      std::this_thread::sleep_for(MESSAGE_URGENT_INTERVAL);
+    }
+  } else {
+    for (int i = 0; i < URGENT_COUNT; ++i) {
+      for (int j = 0; j < BULK_PER_URGENT; ++j)
+        group.send_update({.x = 0, .y = 0, .t = now_ns()}, bulk_lane);
+      group.send_update({.x = URGENT_MARK, .y = 0, .t = now_ns()});
+      std::this_thread::sleep_for(URGENT_INTERVAL);
+    }
+  }
+
+  // Let the queues drain, then signal end of stream to the receiver. The rest
+  // of a message may take longer, urgent updates stuck behind it are lost.
+  std::this_thread::sleep_for(std::chrono::milliseconds(message ? 2000 : 200));
+  boost::asio::post(io_ctx, [&]() {
+    tx->socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send);
+  });
+  rx_thread.join();
+  work.reset();
+  io_ctx.stop();
+  io_thread.join();
+
+  std::printf("mode: %s%s\n", fifo ? "fifo" : "priority",
+              message ? ", message over slow reader" : "");
+  std::printf("urgent updates received: %zu/%d\n", latencies_us.size(),
+              urgent_count);
+  std::printf("urgent latency p50: %.1f us\n", percentile(latencies_us, 0.5));
+  std::printf("urgent latency p99: %.1f us\n", percentile(latencies_us, 0.99));
+  std::printf("urgent latency max: %.1f us\n", percentile(latencies_us, 1.0));
+}
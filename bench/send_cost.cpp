@@ -0,0 +1,143 @@
+// Measures the CPU time spent by `send_update` on the calling thread, with 1
+// and 4 producer threads sending over a loopback link.
+//
+// Usage: ircom_bench_send_cost [--flood] [--trace FILE]
+//
+// By default producers send bursts the link keeps up with. With `--flood`,
+// they send as fast as possible, such that every update overflows its lane.
+// With `--trace`, tracing is enabled and the trace written to FILE.
+
+#include <time.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ircom/ircom.h"
+#include "ircom/trace.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+const int UPDATES_PER_PRODUCER = 200000;
+const int BURST_SIZE = 20;
+const std::chrono::microseconds BURST_INTERVAL{200};
+const std::array<int, 2> PRODUCER_COUNTS = {1, 4};
+
+double thread_cpu_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return static_cast<double>(ts.tv_sec) * 1e9 + static_cast<double>(ts.tv_nsec);
+}
+
+double now_ns() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void run(int producer_count, bool flood) {
+  boost::asio::io_context io_ctx;
+  boost::asio::ip::tcp::acceptor acceptor(
+      io_ctx, boost::asio::ip::tcp::endpoint(
+                  boost::asio::ip::address_v4::loopback(), 0));
+  ircom::link_group group(io_ctx);
+  std::shared_ptr<ircom::update_keeper> tx = group.make_link();
+  boost::asio::ip::tcp::socket rx(io_ctx);
+  tx->socket().connect(acceptor.local_endpoint());
+  acceptor.accept(rx);
+  boost::asio::co_spawn(io_ctx, group.serve(tx), boost::asio::detached);
+
+  auto work = boost::asio::make_work_guard(io_ctx);
+  std::thread io_thread([&]() { io_ctx.run(); });
+
+  std::thread rx_thread([&]() {
+    std::vector<std::uint8_t> buf(1 << 16);
+    boost::system::error_code ec;
+    while (!ec) rx.read_some(boost::asio::buffer(buf), ec);
+  });
+
+  std::atomic<int> ready = 0;
+  std::atomic<bool> go = false;
+  std::vector<double> cpu_ns(producer_count);
+  std::vector<int> queued(producer_count);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < producer_count; ++p) {
+    producers.emplace_back([&, p]() {
+      ++ready;
+      while (!go) std::this_thread::yield();
+
+      for (int i = 0; i < UPDATES_PER_PRODUCER; i += BURST_SIZE) {
+        // Only the sending itself is measured, not the sleeping.
+        double start = thread_cpu_ns();
+        for (int j = 0; j < BURST_SIZE; ++j) {
+          ircom::send_status status =
+              group.send_update({.x = static_cast<double>(p), .y = 0, .t = 0});
+          if (status != ircom::send_status::dropped) ++queued[p];
+        }
+        cpu_ns[p] += thread_cpu_ns() - start;
+        if (!flood) std::this_thread::sleep_for(BURST_INTERVAL);
+      }
+    });
+  }
+  while (ready < producer_count) std::this_thread::yield();
+  double wall_start = now_ns();
+  go = true;
+  for (std::thread& producer : producers) producer.join();
+  double wall_ns = now_ns() - wall_start;
+
+  boost::asio::post(io_ctx, [&]() { group.close_all(); });
+  rx_thread.join();
+  work.reset();
+  io_ctx.stop();
+  io_thread.join();
+
+  double total_cpu_ns = 0;
+  int total_queued = 0;
+  for (int p = 0; p < producer_count; ++p) {
+    total_cpu_ns += cpu_ns[p];
+    total_queued += queued[p];
+  }
+  double total = static_cast<double>(producer_count) * UPDATES_PER_PRODUCER;
+  std::printf("producers: %d\n", producer_count);
+  std::printf("  send cpu per update: %.1f ns\n", total_cpu_ns / total);
+  std::printf("  send throughput: %.2f M updates/s\n", total / wall_ns * 1e3);
+  std::printf("  not dropped: %.1f%%\n", 100.0 * total_queued / total);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool flood = false;
+  const char* trace_path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--flood") == 0) {
+      flood = true;
+    } else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  spdlog::set_level(spdlog::level::err);
+
+  if (trace_path) ircom::trace::start();
+  std::printf("mode: %s%s\n", flood ? "flood" : "bursts",
+              trace_path ? ", traced" : "");
+  for (int producer_count : PRODUCER_COUNTS) run(producer_count, flood);
+
+  if (trace_path) {
+    ircom::trace::stop();
+    std::ofstream out(trace_path);
+    ircom::trace::write_chrome_json(out);
+  }
+}
@@ -0,0 +1,175 @@
+// Measures the update frames per second a server handles over many
+// connections, as connections are sharded over more IO context threads.
+//
+// Usage: ircom_bench_session_scaling [--peers N] [--seconds S]
+//
+// Peers are plain sockets over loopback, driven by their own IO context
+// threads. Inbound, every peer writes update frames as fast as the server
+// decodes them. Outbound, one thread sends updates as fast as possible and
+// every frame written to a peer is counted. Peers share the cores with the
+// server, so scaling flattens before every core serves connections.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "ircom/ircom.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+const std::uint16_t PORT = 40201;
+// Frames written at once by an inbound peer.
+const std::size_t BATCH_FRAMES = 256;
+const std::chrono::milliseconds WARMUP{300};
+
+enum class direction { in, out };
+
+// Plain socket peers of the server, counting the bytes they pass.
+class peers {
+ public:
+  peers(std::size_t count, direction dir) : bytes_(count) {
+    for (std::size_t i = 0; i < count; ++i) {
+      boost::asio::ip::tcp::socket& sock = socks_.emplace_back(io_ctx_);
+      sock.connect(boost::asio::ip::tcp::endpoint(
+          boost::asio::ip::address_v4::loopback(), PORT));
+      sock.set_option(boost::asio::ip::tcp::no_delay(true));
+      boost::asio::co_spawn(io_ctx_, dir == direction::in ? write(i) : read(i),
+                            boost::asio::detached);
+    }
+    std::size_t thread_count =
+        std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+    for (std::size_t i = 0; i < thread_count; ++i)
+      threads_.emplace_back([this]() { io_ctx_.run(); });
+  }
+
+  // Returns once the server closed every connection.
+  ~peers() {
+    for (std::thread& thread : threads_) thread.join();
+  }
+
+  std::uint64_t total_bytes() const {
+    std::uint64_t total = 0;
+    for (const std::atomic<std::uint64_t>& bytes : bytes_)
+      total += bytes.load(std::memory_order_relaxed);
+    return total;
+  }
+
+ private:
+  boost::asio::awaitable<void> write(std::size_t i) {
+    ircom::packet::sequence seq = {
+        .epoch = static_cast<std::uint32_t>(i + 1), .number = 0};
+    std::vector<std::uint8_t> batch;
+    try {
+      while (true) {
+        batch.clear();
+        for (std::size_t j = 0; j < BATCH_FRAMES; ++j) {
+          batch.insert(batch.end(), ircom::packet::HEADER,
+                       ircom::packet::HEADER + ircom::packet::HEADER_SIZE);
+          batch.push_back(ircom::packet::FRAME_UPDATE);
+          seq.serialize(batch);
+          ircom::packet::payload{.x = 1, .y = 2, .t = 3}.serialize(batch);
+          batch.insert(batch.end(), ircom::packet::FOOTER,
+                       ircom::packet::FOOTER + ircom::packet::FOOTER_SIZE);
+          ++seq.number;
+        }
+        co_await boost::asio::async_write(socks_[i],
+                                          boost::asio::buffer(batch),
+                                          boost::asio::use_awaitable);
+        bytes_[i].fetch_add(batch.size(), std::memory_order_relaxed);
+      }
+    } catch (const boost::system::system_error&) {
+      // Closed by the server.
+    }
+  }
+
+  boost::asio::awaitable<void> read(std::size_t i) {
+    std::vector<std::uint8_t> buf(64 * 1024);
+    try {
+      while (true) {
+        std::size_t size = co_await socks_[i].async_read_some(
+            boost::asio::buffer(buf), boost::asio::use_awaitable);
+        bytes_[i].fetch_add(size, std::memory_order_relaxed);
+      }
+    } catch (const boost::system::system_error&) {
+      // Closed by the server.
+    }
+  }
+
+  boost::asio::io_context io_ctx_;
+  std::vector<boost::asio::ip::tcp::socket> socks_;
+  std::vector<std::atomic<std::uint64_t>> bytes_;
+  std::vector<std::thread> threads_;
+};
+
+double run(std::size_t threads, std::size_t peer_count, direction dir,
+           std::chrono::seconds duration) {
+  std::uint64_t frames;
+  {
+    std::optional<peers> ps;
+    {
+      ircom::server srv("ircom-bench-scaling",
+                        {.port = PORT, .threads = threads});
+      ps.emplace(peer_count, dir);
+
+      std::atomic<bool> sending = dir == direction::out;
+      std::thread sender([&]() {
+        double t = 0;
+        while (sending) srv.send_update({.x = 1, .y = 2, .t = t++});
+      });
+
+      std::this_thread::sleep_for(WARMUP);
+      std::uint64_t start_bytes = ps->total_bytes();
+      std::this_thread::sleep_for(duration);
+      frames = (ps->total_bytes() - start_bytes) /
+               ircom::packet::UPDATE_FRAME_SIZE;
+
+      sending = false;
+      sender.join();
+    }
+    // Peers end once the server is destroyed.
+  }
+  return static_cast<double>(frames) /
+         std::chrono::duration<double>(duration).count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::size_t peer_count = 32;
+  std::chrono::seconds duration{2};
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--peers") == 0 && i + 1 < argc) {
+      peer_count = std::strtoul(argv[++i], nullptr, 10);
+    } else if (std::strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+      duration = std::chrono::seconds(std::strtoul(argv[++i], nullptr, 10));
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  spdlog::set_level(spdlog::level::err);
+
+  std::size_t cores =
+      std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  std::vector<std::size_t> thread_counts;
+  for (std::size_t threads = 1; threads < cores; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(cores);
+  if (cores == 1) thread_counts.push_back(2);
+
+  std::printf("peers: %zu, cores: %zu\n", peer_count, cores);
+  std::printf("%-8s %16s %16s\n", "threads", "in frames/s", "out frames/s");
+  for (std::size_t threads : thread_counts) {
+    double in = run(threads, peer_count, direction::in, duration);
+    double out = run(threads, peer_count, direction::out, duration);
+    std::printf("%-8zu %16.0f %16.0f\n", threads, in, out);
+  }
+}
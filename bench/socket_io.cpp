@@ -0,0 +1,206 @@
+// Measures syscalls per frame and update latency between two link groups over
+// loopback.
+//
+// Usage: ircom_bench_socket_io [--timestamps]
+//
+// With `--timestamps`, frames are software timestamped and the latency
+// breakdown of both ends is printed.
+//
+// Socket syscalls are counted by interposing their libc wrappers.
+
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ircom/ircom.h"
+#include "spdlog/spdlog.h"
+
+namespace {
+
+const int BURST_COUNT = 2000;
+const int BURST_SIZE = 8;
+const std::chrono::microseconds BURST_INTERVAL{1000};
+
+enum counted_call {
+  CALL_RECV,
+  CALL_SEND,
+  CALL_RECVMSG,
+  CALL_SENDMSG,
+  CALL_EPOLL_WAIT,
+  CALL_READ,
+  CALL_WRITE,
+  CALL_COUNT,
+};
+const std::array<const char*, CALL_COUNT> CALL_NAMES = {
+    "recv", "send", "recvmsg", "sendmsg", "epoll_wait", "read", "write"};
+std::array<std::atomic<std::uint64_t>, CALL_COUNT> call_counts;
+
+template <typename F>
+F real(const char* name) {
+  return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+double now_ns() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+double percentile(std::vector<double>& samples, double p) {
+  if (samples.empty()) return 0;
+  std::size_t idx = static_cast<std::size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+void print_stage(const char* name, const ircom::latency::stage_stats& st) {
+  std::printf("  %-18s n %5zu  mean %7.1f  p50 %7.1f  p99 %7.1f us\n", name,
+              st.count, st.mean.count() / 1e3, st.p50.count() / 1e3,
+              st.p99.count() / 1e3);
+}
+
+}  // namespace
+
+extern "C" {
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) {
+  static auto f = real<ssize_t (*)(int, void*, size_t, int)>("recv");
+  ++call_counts[CALL_RECV];
+  return f(fd, buf, len, flags);
+}
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) {
+  static auto f = real<ssize_t (*)(int, const void*, size_t, int)>("send");
+  ++call_counts[CALL_SEND];
+  return f(fd, buf, len, flags);
+}
+
+ssize_t recvmsg(int fd, msghdr* msg, int flags) {
+  static auto f = real<ssize_t (*)(int, msghdr*, int)>("recvmsg");
+  ++call_counts[CALL_RECVMSG];
+  return f(fd, msg, flags);
+}
+
+ssize_t sendmsg(int fd, const msghdr* msg, int flags) {
+  static auto f = real<ssize_t (*)(int, const msghdr*, int)>("sendmsg");
+  ++call_counts[CALL_SENDMSG];
+  return f(fd, msg, flags);
+}
+
+int epoll_wait(int epfd, epoll_event* events, int maxevents, int timeout) {
+  static auto f = real<int (*)(int, epoll_event*, int, int)>("epoll_wait");
+  ++call_counts[CALL_EPOLL_WAIT];
+  return f(epfd, events, maxevents, timeout);
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+  static auto f = real<ssize_t (*)(int, void*, size_t)>("read");
+  ++call_counts[CALL_READ];
+  return f(fd, buf, count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  static auto f = real<ssize_t (*)(int, const void*, size_t)>("write");
+  ++call_counts[CALL_WRITE];
+  return f(fd, buf, count);
+}
+
+}  // extern "C"
+
+int main(int argc, char** argv) {
+  ircom::latency::timestamping timestamping =
+      argc > 1 && std::string(argv[1]) == "--timestamps"
+          ? ircom::latency::timestamping::software
+          : ircom::latency::timestamping::off;
+  // The receiving end logs the shutdown of the sending one as an error.
+  spdlog::set_level(spdlog::level::critical);
+
+  // Each end runs its own IO context thread, like two peers.
+  boost::asio::io_context tx_ctx;
+  boost::asio::io_context rx_ctx;
+  ircom::link_group tx_group(tx_ctx, {}, timestamping);
+  ircom::link_group rx_group(rx_ctx, {}, timestamping);
+
+  boost::asio::ip::tcp::acceptor acceptor(
+      rx_ctx, boost::asio::ip::tcp::endpoint(
+                  boost::asio::ip::address_v4::loopback(), 0));
+  std::shared_ptr<ircom::update_keeper> tx = tx_group.make_link();
+  std::shared_ptr<ircom::update_keeper> rx = rx_group.make_link();
+  tx->socket().connect(acceptor.local_endpoint());
+  acceptor.accept(rx->socket());
+  boost::asio::co_spawn(tx_ctx, tx_group.serve(tx), boost::asio::detached);
+  boost::asio::co_spawn(rx_ctx, rx_group.serve(rx), boost::asio::detached);
+
+  auto tx_work = boost::asio::make_work_guard(tx_ctx);
+  auto rx_work = boost::asio::make_work_guard(rx_ctx);
+  std::thread tx_thread([&]() { tx_ctx.run(); });
+  std::thread rx_thread([&]() { rx_ctx.run(); });
+  // Let both links become active.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::atomic<bool> done = false;
+  std::vector<double> latencies_us;
+  std::thread sampler([&]() {
+    double last_x = -1;
+    while (!done) {
+      ircom::packet::payload pl = rx_group.latest_update();
+      if (pl.x != last_x) {
+        last_x = pl.x;
+        latencies_us.push_back((now_ns() - pl.t) / 1e3);
+      }
+      std::this_thread::yield();
+    }
+  });
+
+  for (std::atomic<std::uint64_t>& count : call_counts) count = 0;
+  double x = 0;
+  for (int i = 0; i < BURST_COUNT; ++i) {
+    for (int j = 0; j < BURST_SIZE; ++j)
+      tx_group.send_update({.x = x++, .y = 0, .t = now_ns()});
+    std::this_thread::sleep_for(BURST_INTERVAL);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::array<std::uint64_t, CALL_COUNT> counts;
+  for (int i = 0; i < CALL_COUNT; ++i) counts[i] = call_counts[i];
+
+  done = true;
+  sampler.join();
+  boost::asio::post(tx_ctx, [&]() { tx_group.close_all(); });
+  boost::asio::post(rx_ctx, [&]() { rx_group.close_all(); });
+  tx_work.reset();
+  rx_work.reset();
+  tx_thread.join();
+  rx_thread.join();
+
+  double frames = static_cast<double>(BURST_COUNT) * BURST_SIZE;
+  std::uint64_t total = 0;
+  std::printf("frames: %.0f in bursts of %d\n", frames, BURST_SIZE);
+  for (int i = 0; i < CALL_COUNT; ++i) {
+    std::printf("  %-10s per frame: %.3f\n", CALL_NAMES[i], counts[i] / frames);
+    total += counts[i];
+  }
+  std::printf("  %-10s per frame: %.3f\n", "total", total / frames);
+  std::printf("latency p50: %.1f us\n", percentile(latencies_us, 0.5));
+  std::printf("latency p99: %.1f us\n", percentile(latencies_us, 0.99));
+
+  if (timestamping == ircom::latency::timestamping::off) return 0;
+  ircom::latency::breakdown sent = tx_group.latency_breakdown();
+  ircom::latency::breakdown received = rx_group.latency_breakdown();
+  std::printf("stages:\n");
+  print_stage("queueing", sent.queueing);
+  print_stage("kernel send", sent.kernel_send);
+  print_stage("network round trip", sent.network_round_trip);
+  print_stage("receive", received.receive);
+}
@@ -0,0 +1,99 @@
+#ifndef IRCOM_INCLUDE_IRCOM_BOUNDED_QUEUE_H_
+#define IRCOM_INCLUDE_IRCOM_BOUNDED_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ircom {
+
+// Bounded lock-free FIFO queue, after Dmitry Vyukov's bounded MPMC queue.
+// Cells are allocated once up front, so neither pushing nor popping
+// allocates. `CAP` must be a power of two.
+template <typename T, std::size_t CAP>
+class bounded_queue {
+  static_assert(CAP >= 2 && (CAP & (CAP - 1)) == 0,
+                "Capacity must be a power of two");
+
+ public:
+  bounded_queue() : cells_(std::make_unique<cell[]>(CAP)) {
+    for (std::size_t i = 0; i < CAP; ++i)
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  bounded_queue(const bounded_queue&) = delete;
+  bounded_queue& operator=(const bounded_queue&) = delete;
+
+  // Thread-safe. Returns false if the queue is full, `value` is left
+  // untouched then.
+  bool try_push(T&& value) {
+    std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell& c = cells_[pos & (CAP - 1)];
+      std::ptrdiff_t diff =
+          static_cast<std::ptrdiff_t>(c.seq.load(std::memory_order_acquire)) -
+          static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          c.value = std::move(value);
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Thread-safe. Returns false if the queue is empty.
+  bool try_pop(T& value) {
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell& c = cells_[pos & (CAP - 1)];
+      std::ptrdiff_t diff =
+          static_cast<std::ptrdiff_t>(c.seq.load(std::memory_order_acquire)) -
+          static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          value = std::move(c.value);
+          // Release whatever the moved-from value still holds before the cell
+          // is reused.
+          c.value = T();
+          c.seq.store(pos + CAP, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Thread-safe. Pushes still in progress may not be visible yet.
+  bool empty() const {
+    std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    return cells_[pos & (CAP - 1)].seq.load(std::memory_order_acquire) !=
+           pos + 1;
+  }
+
+ private:
+  struct cell {
+    std::atomic<std::size_t> seq;
+    T value;
+  };
+
+  std::unique_ptr<cell[]> cells_;
+  // On separate cache lines such that both ends do not slow down each other.
+  alignas(64) std::atomic<std::size_t> enqueue_pos_ = 0;
+  alignas(64) std::atomic<std::size_t> dequeue_pos_ = 0;
+};
+
+}  // namespace ircom
+
+#endif
@@ -9,6 +9,11 @@ namespace ircom {
 const std::uint16_t SERVICE_PORT = 40001;
 const std::string SERVICE_PORT_STR = std::to_string(SERVICE_PORT);
 
+// Defaults for `multicast_publisher`. The group is administratively scoped,
+// i.e. never routed beyond the local site.
+const std::uint16_t MULTICAST_PORT = 40002;
+const std::string MULTICAST_GROUP = "239.255.40.1";
+
 }  // namespace ircom
 
 #endif
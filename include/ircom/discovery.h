@@ -11,10 +11,16 @@
 #include "avahi-client/client.h"
 #include "avahi-client/lookup.h"
 #include "avahi-client/publish.h"
+#include "avahi-common/strlst.h"
 #include "avahi-common/thread-watch.h"
+#include "config.h"
 
 namespace ircom::discovery {
 
+const char* const DISCOVERY_SERVICE_TYPE = "_ircom._tcp";
+// Announces a multicast group, see `multicast_publisher`.
+const char* const MULTICAST_SERVICE_TYPE = "_ircom-mcast._udp";
+
 namespace internal {
 
 class avahi_mutex {
@@ -40,7 +46,10 @@ enum publisher_state {
 
 class publisher {
  public:
-  explicit publisher(const char* service_name);
+  explicit publisher(const char* service_name,
+                     const char* service_type = DISCOVERY_SERVICE_TYPE,
+                     std::uint16_t port = SERVICE_PORT,
+                     const std::vector<std::string>& txt = {});
   ~publisher();
 
   publisher(const publisher&) = delete;
@@ -59,6 +68,9 @@ class publisher {
   void set_state_unlocked(internal::publisher_state state);
 
   const char* service_name_;
+  const char* service_type_;
+  std::uint16_t port_;
+  AvahiStringList* txt_ = nullptr;
 
   AvahiThreadedPoll* ev_loop_;
   AvahiClient* client_;
@@ -76,6 +88,8 @@ struct service_info {
   std::string domain;
 
   std::string addr;
+  // TXT record entries, e.g. "key=value".
+  std::vector<std::string> txt;
 };
 
 class closed_exception : public std::exception {
@@ -85,13 +99,17 @@ class closed_exception : public std::exception {
 
 class browser {
  public:
-  explicit browser(const char* target_service_name);
+  explicit browser(const char* target_service_name,
+                   const char* service_type = DISCOVERY_SERVICE_TYPE,
+                   std::uint16_t port = SERVICE_PORT);
   ~browser();
 
   browser(const browser&) = delete;
   browser& operator=(const browser&) = delete;
 
   service_info get_latest_service();
+  // Returns every currently resolved instance without waiting.
+  std::vector<service_info> get_services();
 
   void close();
 
@@ -112,6 +130,8 @@ class browser {
   bool has_service_unlocked();
 
   const char* target_service_name_;
+  const char* service_type_;
+  std::uint16_t port_;
 
   AvahiThreadedPoll* ev_loop_;
   AvahiClient* client_;
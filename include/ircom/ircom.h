@@ -1,13 +1,27 @@
 #ifndef IRCOM_INCLUDE_IRCOM_IRCOM_H_
 #define IRCOM_INCLUDE_IRCOM_IRCOM_H_
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "boost/circular_buffer.hpp"
+#include "bounded_queue.h"
 #include "config.h"
 #include "discovery.h"
+#include "latency.h"
+#include "message.h"
 #include "packet.h"
 
 // Before Boost.Asio 1.79.0, "boost/asio/awaitable.hpp" does not include
@@ -20,88 +34,664 @@
 
 namespace ircom {
 
+// Capacity of each outbound lane.
 const std::size_t UPDATE_BUF_CAP = 200;
+// Capacity of each queue carrying sent updates to the IO context thread. Once
+// full, the oldest submission is evicted unless the overflow policy is
+// `drop_newest`.
+const std::size_t SUBMISSION_QUEUE_CAP = 1024;
+// Updates are handed to a link only while it has fewer queued updates than
+// this, such that congestion builds up where `send_options::overflow` applies.
+const std::size_t LINK_BACKLOG_CAP = 2;
+// Number of received messages kept until the user takes them.
+const std::size_t MESSAGE_INBOX_CAP = 16;
+// Number of sent messages not yet written to or dropped by every connection.
+// Further messages are dropped.
+const std::size_t MESSAGE_QUEUE_CAP = 16;
+// Size of the buffer each link reads received bytes into, at once if they are
+// available, before decoding frames from it.
+const std::size_t RECEIVE_BUF_SIZE = 64 * 1024;
+// Unsent bytes the kernel may hold for a link before it writes another bulk
+// frame. Bounds what an urgent frame queues behind in the send buffer, which
+// otherwise grows to megabytes when the peer reads slowly.
+const int BULK_NOTSENT_LOWAT = 16 * 1024;
+// Frames written by a link and not timestamped yet, per timestamp kind. Older
+// ones are forgotten, e.g. if the kernel does not provide the timestamps.
+const std::size_t TX_TIMESTAMP_BACKLOG_CAP = 1024;
+// Pings and pongs waiting to be written per link, older ones are dropped.
+const std::size_t PROBE_QUEUE_CAP = 16;
+// A hot standby client pings its links this many times per heartbeat
+// interval, and shuts down those silent for 3/4 of it. A dead primary is
+// therefore replaced within one interval.
+const int PINGS_PER_HEARTBEAT_INTERVAL = 8;
+// Connection attempts of a latency probe taking longer are given up.
+const std::chrono::milliseconds PROBE_TIMEOUT{500};
+// Instances are discovered one at a time. Before first probing latency, a
+// client waits this long after the first one for the others.
+const std::chrono::milliseconds PROBE_SETTLE_TIME{500};
+// A probed instance replaces the current one only if it connects in less than
+// this fraction of the current one's time, such that jitter does not make the
+// client flap between instances.
+const double MIGRATION_CONNECT_TIME_RATIO = 0.5;
+// How often a redundant client looks for newly discovered service instances.
+const std::chrono::milliseconds DISCOVERY_POLL_INTERVAL{500};
 
-// Manages updates passing between multiple threads.
-class update_keeper {
+// Scheduling class of an outbound frame. The write loop always drains the
+// urgent lane before writing the next bulk frame, and only writes a bulk frame
+// once less than `BULK_NOTSENT_LOWAT` bytes are left unsent. An urgent frame is
+// thus delayed by at most one bulk frame plus that many bytes. Message chunks
+// always go through the bulk lane.
+enum class lane {
+  urgent,
+  bulk,
+};
+
+// What happens to an update sent while its lane is full.
+enum class overflow_policy {
+  // The oldest queued update is dropped.
+  drop_oldest,
+  // The new update is dropped.
+  drop_newest,
+  // The new update replaces the newest queued one.
+  conflate,
+};
+
+enum class send_status {
+  queued,
+  // Queued while the lane was full, in place of the newest queued update,
+  // which then is not sent and its receipt resolves to false. Nothing is
+  // replaced if the lane drained before the update reached it, so this may
+  // overstate the congestion.
+  conflated,
+  // Not sent, either due to overflow or because no connection is up.
+  dropped,
+};
+
+struct send_receipt {
+  send_status status;
+  // Becomes true once the update is written to at least one connection, or
+  // false if it is dropped on every connection.
+  std::future<bool> written;
+};
+
+struct send_options {
+  // Token bucket pacing of outbound updates. Zero disables pacing.
+  double max_updates_per_sec = 0;
+  // Number of updates that may be sent back-to-back after being idle.
+  std::size_t burst = 8;
+  overflow_policy overflow = overflow_policy::drop_oldest;
+};
+
+class update_keeper;
+
+namespace internal {
+
+// Resolves a `send_receipt`. Resolved as not written once the last copy of
+// the update is released without being written.
+class delivery {
+ public:
+  delivery() {}
+  ~delivery() { complete(false); }
+
+  delivery(const delivery&) = delete;
+  delivery& operator=(const delivery&) = delete;
+
+  std::future<bool> get_future() { return written_.get_future(); }
+  void complete(bool written) {
+    if (!done_.exchange(true)) written_.set_value(written);
+  }
+
+ private:
+  std::promise<bool> written_;
+  std::atomic<bool> done_ = false;
+};
+
+struct pending_update {
+  packet::payload pl;
+  std::shared_ptr<delivery> dl;
+  // Only set with timestamping.
+  std::chrono::system_clock::time_point submitted_at;
+  // Set if numbered when submitted, otherwise numbered once dispatched.
+  std::optional<std::uint32_t> number;
+};
+
+struct submitted_update {
+  packet::payload pl;
+  std::shared_ptr<delivery> dl;
+  std::chrono::system_clock::time_point submitted_at;
+  std::optional<std::uint32_t> number;
+  // Whether the lane was full when sent, such that the overflow policy
+  // applies.
+  bool overflowed = false;
+};
+
+struct outbound_update {
+  packet::sequence seq;
+  packet::payload pl;
+  std::shared_ptr<delivery> dl;
+  std::chrono::system_clock::time_point submitted_at;
+};
+
+struct outbound_probe {
+  packet::frame_type type;
+  packet::probe pr;
+};
+
+// An instance connected to by a latency probe.
+struct probe_result {
+  discovery::service_info info;
+  std::shared_ptr<update_keeper> keeper;
+  // Of the TCP handshake, i.e. about one round trip.
+  std::chrono::steady_clock::duration connect_time;
+};
+
+// A frame written by a link, awaiting a TX timestamp.
+struct written_frame {
+  // Bytes written to the connection up to the end of the frame, wrapping.
+  std::uint32_t end;
+  std::chrono::system_clock::time_point at;
+};
+
+struct outbound_message {
+  std::uint32_t epoch;
+  std::uint32_t id;
+  // Referenced in place, `owner` keeps it alive until fully written.
+  boost::asio::const_buffer data;
+  std::shared_ptr<const void> owner;
+  std::size_t offset = 0;
+};
+
+}  // namespace internal
+
+// Receive-side state shared by every connection to the same peer. The same
+// frame may arrive over several connections, only the first copy is kept.
+class inbox {
+ public:
+  inbox() {}
+
+  inbox(const inbox&) = delete;
+  inbox& operator=(const inbox&) = delete;
+
+  // Returns false if the update is not newer than the latest accepted one.
+  bool accept_update(const packet::sequence& seq, const packet::payload& pl);
+  packet::payload latest_update();
+
+  // Whether the message was not delivered yet. Used to skip reassembly early.
+  bool is_new_message(std::uint32_t epoch, std::uint32_t id);
+  // Returns false if the message was already delivered.
+  bool accept_message(std::uint32_t epoch, std::uint32_t id,
+                      message::buffer msg);
+  // Returns the oldest fully received message, if any.
+  std::optional<message::buffer> next_message();
+
+ private:
+  bool is_new_message_unlocked(std::uint32_t epoch, std::uint32_t id);
+
+  std::mutex mtx_;
+
+  bool has_update_ = false;
+  packet::sequence latest_update_seq_;
+  packet::payload latest_update_;
+
+  // Sliding window over the most recent message IDs, as messages may complete
+  // out of order across connections.
+  bool has_message_ = false;
+  std::uint32_t message_epoch_ = 0;
+  std::uint32_t highest_message_id_ = 0;
+  std::uint64_t message_id_window_ = 0;
+
+  std::deque<message::buffer> messages_;
+};
+
+namespace internal {
+
+// State of a link group, shared by every shard of a server such that a peer
+// connected to several shards (e.g. a redundant client) sees one sender.
+struct group_state {
+  explicit group_state(latency::timestamping timestamping);
+
+  group_state(const group_state&) = delete;
+  group_state& operator=(const group_state&) = delete;
+
+  inbox ib;
+  latency::recorder recorder;
+
+  // Picked randomly such that a restarted peer is never mistaken as stale.
+  const std::uint32_t epoch;
+  std::atomic<std::uint32_t> next_update_seq = 0;
+  std::atomic<std::uint32_t> next_message_id = 0;
+  // Counted against `MESSAGE_QUEUE_CAP`, by every shard together.
+  std::atomic<std::size_t> messages_pending = 0;
+};
+
+// Wraps the owner of a message such that the message counts against
+// `MESSAGE_QUEUE_CAP` until every link wrote or dropped it. Returns null once
+// the cap is reached. Throws `std::invalid_argument` if the message is larger
+// than `packet::MESSAGE_MAX_SIZE`.
+std::shared_ptr<const void> admit_message(
+    const std::shared_ptr<group_state>& state, boost::asio::const_buffer data,
+    std::shared_ptr<const void> owner);
+
+}  // namespace internal
+
+// Manages frames passing over one connection. Must be owned by a
+// `std::shared_ptr`, see `link_group::make_link`.
+class update_keeper : public std::enable_shared_from_this<update_keeper> {
  public:
-  update_keeper(boost::asio::ip::tcp::socket& sock) : sock_(sock) {}
+  // `on_update_written` is called from the socket's executor after every
+  // written update. With `latency`, frames are timestamped and their stages
+  // recorded into it.
+  update_keeper(boost::asio::ip::tcp::socket sock, inbox& ib,
+                std::function<void()> on_update_written = {},
+                latency::recorder* latency = nullptr);
 
   update_keeper(const update_keeper&) = delete;
   update_keeper& operator=(const update_keeper&) = delete;
 
-  void send_update(const packet::payload& pl);
-  packet::payload latest_update();
+  boost::asio::ip::tcp::socket& socket() { return sock_; }
+
+  // Tunes a freshly connected socket for low latency and enables timestamping,
+  // if any. Should be called once per connection before `handle_updates`.
+  void configure_socket();
+
+  // Must be called from the socket's executor. Frames are dropped unless
+  // `handle_updates` is running and the link is not on standby.
+  void enqueue_update(const internal::outbound_update& update, lane ln);
+  void enqueue_message(internal::outbound_message msg);
+  // Must be called from the socket's executor. Answered by the peer, which
+  // refreshes `last_received_at` and `round_trip_time`.
+  void send_ping();
+
+  // Whether `handle_updates` is running.
+  bool is_connected() const { return active_; }
+  // Whether frames are handed to this link, i.e. connected and not on
+  // standby.
+  bool is_active() const { return active_ && !standby_; }
+  // A link on standby is kept connected and answers pings, but neither sends
+  // nor delivers updates and messages.
+  void set_standby(bool standby) { standby_ = standby; }
+  bool is_standby() const { return standby_; }
+  // Time of the last read, or of connecting.
+  std::chrono::steady_clock::time_point last_received_at() const {
+    return last_received_at_;
+  }
+  // Of the last answered ping, if any.
+  std::optional<std::chrono::steady_clock::duration> round_trip_time() const {
+    return round_trip_time_;
+  }
+  // Number of queued updates of the lane.
+  std::size_t update_backlog(lane ln) const {
+    return (ln == lane::urgent ? urgent_buf_ : bulk_buf_).size();
+  }
+
   boost::asio::awaitable<void> handle_updates();
 
  private:
-  boost::asio::awaitable<void> flush_queue(packet::payload pl);
+  void wake_write_loop();
+  boost::asio::awaitable<void> write_loop();
+  // Whether less than `BULK_NOTSENT_LOWAT` bytes are unsent, without waiting.
+  bool is_bulk_writable();
+  // Wakes the write loop once a bulk frame may be written. Waits apart from
+  // the write loop, such that urgent frames are written meanwhile.
+  boost::asio::awaitable<void> wait_bulk_writable();
+  boost::asio::awaitable<void> write_probes();
+  // Writes up to `max_count` updates of the lane at once.
+  boost::asio::awaitable<void> write_updates(
+      boost::circular_buffer<internal::outbound_update>& buf,
+      std::size_t max_count);
+  boost::asio::awaitable<void> write_message_chunk();
+  // Ensures at least `size` received bytes are buffered, reading as many as
+  // are available.
+  boost::asio::awaitable<void> fill(std::size_t size);
+  // Reads like `async_read_some`, additionally taking the RX timestamp.
+  boost::asio::awaitable<std::size_t> read_some_timestamped(
+      boost::asio::mutable_buffer buf);
+  boost::asio::awaitable<void> receive_chunk();
+  // Records the stages of written frames whose TX timestamps arrived. Called
+  // after every write and before waiting to read, the timestamps are taken by
+  // the kernel so collecting them late is harmless.
+  void collect_tx_timestamps();
+  boost::circular_buffer<internal::outbound_update>& lane_buf(lane ln);
+  void clear_outbound();
 
-  boost::asio::ip::tcp::socket& sock_;
+  boost::asio::ip::tcp::socket sock_;
+  inbox& inbox_;
+  std::function<void()> on_update_written_;
 
-  bool update_buf_rotated_ = false;
-  boost::circular_buffer<packet::payload> update_buf_{UPDATE_BUF_CAP};
+  // Received bytes not decoded yet are [rx_begin_, rx_end_) of `rx_buf_`.
+  std::vector<std::uint8_t> rx_buf_;
+  std::size_t rx_begin_ = 0;
+  std::size_t rx_end_ = 0;
 
-  packet::payload latest_update_;
-  std::mutex latest_update_mtx_;
+  // Null unless timestamping is enabled on this connection.
+  latency::recorder* latency_;
+  std::chrono::system_clock::time_point rx_timestamp_;
+  std::uint32_t tx_bytes_ = 0;
+  std::deque<internal::written_frame> awaiting_sent_;
+  std::deque<internal::written_frame> awaiting_acked_;
+
+  // Reused across writes, such that serializing frames does not allocate.
+  std::vector<std::uint8_t> tx_buf_;
+  std::vector<internal::outbound_update> tx_updates_;
+
+  // Whether `handle_updates` is running, i.e. the connection is usable.
+  bool active_ = false;
+  bool standby_ = false;
+  std::chrono::steady_clock::time_point last_received_at_;
+  std::optional<std::chrono::steady_clock::duration> round_trip_time_;
+
+  // Whether `write_loop` is currently draining the lanes. The loop holds a
+  // reference to the keeper, as a pending write may only be aborted after
+  // the link was removed.
+  bool write_loop_active_ = false;
+  // Whether `wait_bulk_writable` is running, holding a reference likewise.
+  bool bulk_wait_active_ = false;
+  // Written before either lane, they are tiny and time sensitive.
+  boost::circular_buffer<internal::outbound_probe> probe_queue_{
+      PROBE_QUEUE_CAP};
+  boost::circular_buffer<internal::outbound_update> urgent_buf_{
+      UPDATE_BUF_CAP};
+  boost::circular_buffer<internal::outbound_update> bulk_buf_{UPDATE_BUF_CAP};
+  // Messages share the bulk lane with bulk updates round-robin. Bounded by
+  // `MESSAGE_QUEUE_CAP`, see `internal::admit_message`.
+  std::deque<internal::outbound_message> message_queue_;
+  bool bulk_prefer_message_ = false;
+
+  message::buffer_pool message_pool_;
+  // Message being reassembled, chunks are read directly into it.
+  std::optional<message::buffer> reassembly_;
+  std::uint32_t reassembly_epoch_ = 0;
+  std::uint32_t reassembly_id_ = 0;
+  std::size_t reassembly_received_ = 0;
+  // Sink for chunks of messages that are not reassembled.
+  std::vector<std::uint8_t> discard_buf_;
+};
+
+// Connections to the same peer, e.g. one per network interface. Every frame is
+// sent over all connected links with the same sequence number and deduplicated
+// by the receiving `inbox`, so delivery tracks the best link at each moment.
+//
+// Updates are first admitted into the group's own lanes, where pacing and the
+// overflow policy apply, and handed to the links once they can take more.
+// Sending threads only push into a lock-free queue per lane and count the lane
+// occupancy, the IO context thread is woken once per batch to move them into
+// the lanes.
+class link_group {
+ public:
+  explicit link_group(
+      boost::asio::io_context& io_ctx, const send_options& opts = {},
+      latency::timestamping timestamping = latency::timestamping::off);
+  // A shard of a server, sharing `state` with the other shards.
+  link_group(boost::asio::io_context& io_ctx,
+             std::shared_ptr<internal::group_state> state,
+             const send_options& opts);
+
+  link_group(const link_group&) = delete;
+  link_group& operator=(const link_group&) = delete;
+
+  // Thread-safe.
+  send_status send_update(const packet::payload& pl, lane ln = lane::urgent);
+  // Like `send_update`, additionally reporting when the update is written.
+  send_receipt send_update_tracked(const packet::payload& pl,
+                                   lane ln = lane::urgent);
+  packet::payload latest_update();
+  // Dropped if `MESSAGE_QUEUE_CAP` messages are still queued, or if no link is
+  // active. Throws `std::invalid_argument` if larger than
+  // `packet::MESSAGE_MAX_SIZE`.
+  send_status send_message(boost::asio::const_buffer data,
+                           std::shared_ptr<const void> owner);
+  std::optional<message::buffer> next_message();
+  // Empty unless timestamping is enabled.
+  latency::breakdown latency_breakdown();
+
+  // Thread-safe. For shards, numbered by the caller from the shared state,
+  // such that every shard sends them under the same number.
+  send_status send_numbered_update(std::uint32_t number,
+                                   const packet::payload& pl, lane ln,
+                                   std::shared_ptr<internal::delivery> dl);
+  // `owner` comes from `internal::admit_message`, such that the message is
+  // counted once for every shard.
+  send_status send_numbered_message(std::uint32_t id,
+                                    boost::asio::const_buffer data,
+                                    std::shared_ptr<const void> owner);
+
+  // The following MUST BE called from the IO context thread.
+
+  // Creates an unconnected link. It is closed by `close_all` until removed.
+  std::shared_ptr<update_keeper> make_link();
+  // Creates a link over an already connected socket of the IO context.
+  std::shared_ptr<update_keeper> make_link(boost::asio::ip::tcp::socket sock);
+  void remove(const std::shared_ptr<update_keeper>& keeper);
+  // Like `update_keeper::set_standby`, additionally letting updates held back
+  // for lack of an active link through.
+  void set_standby(const std::shared_ptr<update_keeper>& keeper, bool standby);
+  // Handles frames of a connected link until it fails, then removes it.
+  // Returns false if the link group has been closed.
+  boost::asio::awaitable<bool> serve(std::shared_ptr<update_keeper> keeper);
+  // Pings every connected link, and shuts down those from which nothing was
+  // received for longer than `silence_limit`, e.g. as the peer lost power.
+  void ping_links(std::chrono::steady_clock::duration silence_limit);
+  void close_all();
+
+ private:
+  send_status admit(internal::pending_update update, lane ln);
+  // Moves submitted updates into the lanes.
+  void drain_submissions();
+  void drain_submissions(lane ln);
+  boost::asio::awaitable<void> dispatch_loop();
+  // Time to wait before the next update can be handed to the links.
+  std::chrono::steady_clock::duration dispatch_delay();
+  // Wakes the dispatcher waiting for a link, once a link wrote an update, the
+  // active links changed or an urgent update overtakes held back bulk ones.
+  void wake_dispatcher();
+
+  boost::asio::io_context& io_ctx_;
+  send_options opts_;
+
+  std::shared_ptr<internal::group_state> state_;
+
+  bounded_queue<internal::submitted_update, SUBMISSION_QUEUE_CAP>
+      urgent_submissions_;
+  bounded_queue<internal::submitted_update, SUBMISSION_QUEUE_CAP>
+      bulk_submissions_;
+  // Whether `dispatch_loop` is running or about to.
+  std::atomic<bool> dispatch_scheduled_ = false;
+  // Updates per lane either submitted or admitted, not yet handed to the
+  // links. Lets sending threads apply the overflow policy without a lock.
+  std::atomic<std::size_t> urgent_pending_ = 0;
+  std::atomic<std::size_t> bulk_pending_ = 0;
+
+  // Admitted updates not yet handed to the links.
+  boost::circular_buffer<internal::pending_update> urgent_buf_{UPDATE_BUF_CAP};
+  boost::circular_buffer<internal::pending_update> bulk_buf_{UPDATE_BUF_CAP};
+
+  boost::asio::steady_timer dispatch_timer_;
+  bool waiting_for_link_ = false;
+  // Whether the dispatcher waits for a link to take a bulk update. Sending an
+  // urgent update then wakes it, as urgent updates are not held back by bulk
+  // ones.
+  std::atomic<bool> bulk_held_ = false;
+  double tokens_;
+  std::chrono::steady_clock::time_point tokens_refilled_at_;
+
+  std::vector<std::shared_ptr<update_keeper>> links_;
+  std::atomic<std::size_t> active_links_ = 0;
+  bool closed_ = false;
+};
+
+namespace internal {
+
+// Connections served by one of the IO context threads of a server.
+struct server_shard {
+  server_shard(std::shared_ptr<group_state> state, const send_options& opts)
+      : links(io_ctx, std::move(state), opts) {}
+
+  boost::asio::io_context io_ctx;
+  // Keeps `io_ctx` running while no connection is served.
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work = boost::asio::make_work_guard(io_ctx);
+  link_group links;
+  std::thread thread;
+};
+
+}  // namespace internal
+
+struct server_options {
+  // TCP port listened on and announced through service discovery.
+  std::uint16_t port = SERVICE_PORT;
+  // IO context threads accepted connections are spread over, round robin.
+  // Zero starts one per core. With several, an update is numbered once sent
+  // instead of once dispatched, so an update may be dropped as stale by the
+  // peer when an update sent later on the urgent lane overtook it.
+  std::size_t threads = 1;
+
+  send_options send;
+  // Kernel timestamps feeding `latency_breakdown`.
+  latency::timestamping timestamping = latency::timestamping::off;
 };
 
 class server {
  public:
-  explicit server(const char* service_name);
+  explicit server(const char* service_name, const server_options& opts = {});
   ~server();
 
   server(const server&) = delete;
   server& operator=(const server&) = delete;
 
-  void send_update(const packet::payload& pl);
+  send_status send_update(const packet::payload& pl, lane ln = lane::urgent);
+  send_receipt send_update_tracked(const packet::payload& pl,
+                                   lane ln = lane::urgent);
   packet::payload latest_update();
 
+  send_status send_message(boost::asio::const_buffer data,
+                           std::shared_ptr<const void> owner);
+  std::optional<message::buffer> next_message();
+  latency::breakdown latency_breakdown();
+
  private:
   boost::asio::awaitable<void> handler();
+  boost::asio::awaitable<void> session(link_group& links,
+                                       boost::asio::ip::tcp::socket sock);
+  send_status send_to_shards(const packet::payload& pl, lane ln,
+                             std::shared_ptr<internal::delivery> dl);
+  void stop_all();
   void io_ctx_thread_f();
 
   discovery::publisher publisher_;
 
-  // IMPORTANT: The IO context MUST BE ran from one thread only, required for
-  // graceful shutdown to work. Use a strand if multiple threads are needed.
+  // IMPORTANT: Every IO context MUST BE ran from one thread only, required
+  // for graceful shutdown to work. Connections are sharded over IO contexts
+  // instead.
   boost::asio::io_context io_ctx_;
-  boost::asio::ip::tcp::acceptor acceptor_{
-      io_ctx_,
-      boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), SERVICE_PORT)};
-  boost::asio::ip::tcp::socket sock_{io_ctx_};
+  boost::asio::ip::tcp::acceptor acceptor_;
   std::thread io_ctx_thread_;
 
-  update_keeper udkeeper_{sock_};
+  std::shared_ptr<internal::group_state> state_;
+  // Every accepted connection is served concurrently, such that a redundant
+  // client can connect over all of its interfaces. Serves the first shard.
+  link_group links_;
+  // The other shards, if any.
+  std::vector<std::unique_ptr<internal::server_shard>> shards_;
+  // Owned by `io_ctx_`.
+  std::size_t next_shard_ = 0;
 
   bool shutdown_issued_ = false;
 };
 
+struct client_options {
+  // Keeps a connection to every discovered instance of the target service,
+  // e.g. the same server over several network interfaces, and sends every
+  // frame over all of them. Otherwise only the latest discovered instance is
+  // used.
+  bool redundant = false;
+  // Only instances announced on this port are connected to.
+  std::uint16_t port = SERVICE_PORT;
+  // Additionally keeps a standby connection to a second instance of the
+  // target service, e.g. a backup base station, and fails over to it once
+  // the primary dies. Ignored in redundant mode.
+  bool hot_standby = false;
+  // In hot standby mode, a dead primary is replaced within this interval, as
+  // long as round trip times stay well below half of it.
+  std::chrono::milliseconds heartbeat_interval{100};
+  // Connects to every discovered instance at once and keeps the one
+  // connecting the fastest, instead of the latest discovered. Connecting
+  // first is delayed by `PROBE_SETTLE_TIME`. Ignored in redundant and hot
+  // standby modes.
+  bool probe_latency = false;
+  // When probing latency, probes again with this interval, and migrates to
+  // a clearly faster instance, e.g. once a wired interface comes up. Zero
+  // disables probing again.
+  std::chrono::milliseconds reprobe_interval{0};
+
+  send_options send;
+  // Kernel timestamps feeding `latency_breakdown`.
+  latency::timestamping timestamping = latency::timestamping::off;
+};
+
 class client {
  public:
-  explicit client(const char* target_service_name);
+  explicit client(const char* target_service_name,
+                  const client_options& opts = {});
   ~client();
 
   client(const client&) = delete;
   client& operator=(const client&) = delete;
 
-  void send_update(const packet::payload& pl);
+  send_status send_update(const packet::payload& pl, lane ln = lane::urgent);
+  send_receipt send_update_tracked(const packet::payload& pl,
+                                   lane ln = lane::urgent);
   packet::payload latest_update();
 
+  send_status send_message(boost::asio::const_buffer data,
+                           std::shared_ptr<const void> owner);
+  std::optional<message::buffer> next_message();
+  latency::breakdown latency_breakdown();
+
  private:
   boost::asio::awaitable<void> connect();
+  boost::asio::awaitable<void> maintain_links();
+  boost::asio::awaitable<void> run_link(discovery::service_info info);
+  boost::asio::awaitable<void> maintain_hot_standby();
+  boost::asio::awaitable<void> run_hot_standby_link(
+      discovery::service_info info, bool standby);
+  // Returns false if there is no connected standby link.
+  bool promote_standby();
+  boost::asio::awaitable<void> reprobe();
+  // Returns the instances connected to within `PROBE_TIMEOUT`, the fastest
+  // first.
+  boost::asio::awaitable<std::vector<internal::probe_result>> probe_services(
+      std::vector<discovery::service_info> candidates);
+  // Returns false if the connection attempt was cancelled.
+  boost::asio::awaitable<bool> connect_link(
+      const discovery::service_info& info,
+      std::shared_ptr<update_keeper>& keeper);
+  bool is_service_available(const discovery::service_info& info);
   void io_ctx_thread_f();
 
+  client_options opts_;
+
   discovery::browser browser_;
 
   // IMPORTANT: The IO context MUST BE ran from one thread only, required for
   // graceful shutdown to work. Use a strand if multiple threads are needed.
   boost::asio::io_context io_ctx_;
   boost::asio::ip::tcp::resolver resolver_{io_ctx_};
-  boost::asio::ip::tcp::socket sock_{io_ctx_};
+  boost::asio::steady_timer discovery_timer_{io_ctx_};
+  boost::asio::steady_timer reprobe_timer_{io_ctx_};
   std::thread io_ctx_thread_;
 
-  update_keeper udkeeper_{sock_};
+  link_group links_{io_ctx_, opts_.send, opts_.timestamping};
+  // Services with a running `run_link`, in redundant mode.
+  std::set<std::pair<AvahiIfIndex, std::string>> linked_services_;
+
+  // In hot standby mode. Services are set from connecting on, links once
+  // connected. The primary is also the link served when probing latency.
+  std::optional<discovery::service_info> primary_service_;
+  std::shared_ptr<update_keeper> primary_;
+  std::optional<discovery::service_info> standby_service_;
+  std::shared_ptr<update_keeper> standby_;
+  // When probing latency, the connected instance to serve next.
+  std::optional<internal::probe_result> migration_;
 
   bool shutdown_issued_ = false;
 };
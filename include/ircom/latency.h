@@ -0,0 +1,91 @@
+#ifndef IRCOM_INCLUDE_IRCOM_LATENCY_H_
+#define IRCOM_INCLUDE_IRCOM_LATENCY_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "boost/circular_buffer.hpp"
+
+namespace ircom::latency {
+
+// Number of most recent samples each stage's statistics are computed over.
+const std::size_t WINDOW = 4096;
+
+// Source of the kernel timestamps taken for every frame of a connection, see
+// SO_TIMESTAMPING.
+enum class timestamping {
+  off,
+  // Taken by the kernel when a frame is handed to and received from the
+  // driver.
+  software,
+  // Taken by the NIC when a frame is sent and received. The NIC must have
+  // timestamping enabled (e.g. with `hwstamp_ctl`) and its clock must be
+  // synchronized to the system clock (e.g. with `phc2sys`). Acknowledgements
+  // are still timestamped in software.
+  hardware,
+};
+
+// Stages an update goes through. Only the sending and the receiving ends are
+// timestamped on the same clock each, so the one-way network delay is not
+// available, the round trip through the network is.
+enum class stage {
+  // From `send_update` until written to the socket, i.e. pacing and queueing
+  // in the lanes.
+  queueing,
+  // From written to the socket until the TX timestamp, i.e. the kernel send
+  // path, and the driver queue with hardware timestamps.
+  kernel_send,
+  // From the TX timestamp until the peer's kernel acknowledged the frame.
+  // Includes delayed acknowledgements, if any.
+  network_round_trip,
+  // From the RX timestamp of a received update until it is decoded, i.e. the
+  // kernel receive path and waiting for the IO context thread.
+  receive,
+};
+const std::size_t STAGE_COUNT = 4;
+
+struct stage_stats {
+  // Samples over the window, zero if the stage was never timestamped.
+  std::size_t count = 0;
+  std::chrono::nanoseconds mean{0};
+  std::chrono::nanoseconds p50{0};
+  std::chrono::nanoseconds p99{0};
+  std::chrono::nanoseconds max{0};
+};
+
+struct breakdown {
+  stage_stats queueing;
+  stage_stats kernel_send;
+  stage_stats network_round_trip;
+  stage_stats receive;
+};
+
+// Collects stage durations of the frames of every connection of a link
+// group. Thread-safe.
+class recorder {
+ public:
+  explicit recorder(timestamping mode);
+
+  recorder(const recorder&) = delete;
+  recorder& operator=(const recorder&) = delete;
+
+  timestamping mode() const { return mode_; }
+
+  void record(stage st, std::chrono::nanoseconds duration);
+  breakdown snapshot();
+
+ private:
+  stage_stats stats(stage st) const;
+
+  const timestamping mode_;
+
+  std::mutex mtx_;
+  std::array<boost::circular_buffer<std::int64_t>, STAGE_COUNT> samples_;
+};
+
+}  // namespace ircom::latency
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef IRCOM_INCLUDE_IRCOM_MESSAGE_H_
+#define IRCOM_INCLUDE_IRCOM_MESSAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ircom::message {
+
+namespace internal {
+
+struct pool_state {
+  std::size_t max_cached;
+  std::vector<std::vector<std::uint8_t>> free_storages;
+  std::mutex mtx;
+};
+
+}  // namespace internal
+
+// A variable-length message backed by pooled storage. The storage is handed
+// back to its pool on destruction, so buffers can be passed around freely
+// without copying and without reallocating for every received message.
+class buffer {
+ public:
+  buffer(buffer&& other) noexcept;
+  buffer& operator=(buffer&& other) noexcept;
+  ~buffer();
+
+  buffer(const buffer&) = delete;
+  buffer& operator=(const buffer&) = delete;
+
+  std::uint8_t* data() { return storage_.data(); }
+  const std::uint8_t* data() const { return storage_.data(); }
+  std::size_t size() const { return size_; }
+
+ private:
+  friend class buffer_pool;
+
+  buffer(std::shared_ptr<internal::pool_state> pool,
+         std::vector<std::uint8_t> storage, std::size_t size);
+
+  void release();
+
+  std::shared_ptr<internal::pool_state> pool_;
+  // May be larger than `size_` when reused from a previous message.
+  std::vector<std::uint8_t> storage_;
+  std::size_t size_;
+};
+
+// Thread-safe free list of message storages. Buffers may outlive the pool.
+class buffer_pool {
+ public:
+  explicit buffer_pool(std::size_t max_cached = 8);
+
+  buffer_pool(const buffer_pool&) = delete;
+  buffer_pool& operator=(const buffer_pool&) = delete;
+
+  buffer acquire(std::size_t size);
+
+ private:
+  std::shared_ptr<internal::pool_state> state_;
+};
+
+}  // namespace ircom::message
+
+#endif
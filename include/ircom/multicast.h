@@ -0,0 +1,118 @@
+#ifndef IRCOM_INCLUDE_IRCOM_MULTICAST_H_
+#define IRCOM_INCLUDE_IRCOM_MULTICAST_H_
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "config.h"
+#include "discovery.h"
+#include "ircom.h"
+#include "packet.h"
+
+// Before Boost.Asio 1.79.0, "boost/asio/awaitable.hpp" does not include
+// <utility> causing `std::exchange` to be missing. Fixed by commit
+// 71964b22c7fade69cc4caa1c869a868e3a32cc97. Backported to here.
+// clang-format off
+#include <utility>
+#include "boost/asio.hpp"
+// clang-format on
+
+namespace ircom {
+
+// Prefix of the TXT record entry announcing the multicast group.
+const std::string MULTICAST_TXT_GROUP_KEY = "group=";
+// Prefix of the TXT record entry announcing the epoch of the publisher, such
+// that subscribers ignore anyone else sending to the group.
+const std::string MULTICAST_TXT_EPOCH_KEY = "epoch=";
+
+struct multicast_options {
+  // Only used by subscribers if the publisher does not announce its group.
+  std::string group = MULTICAST_GROUP;
+  std::uint16_t port = MULTICAST_PORT;
+  // Hop limit of outbound datagrams, 1 keeps them on the local network.
+  int ttl = 1;
+};
+
+// Sends updates to every subscriber at once over UDP multicast, i.e. one
+// datagram per update regardless of the number of subscribers. The group is
+// announced over mDNS as a `MULTICAST_SERVICE_TYPE` service.
+//
+// Delivery is best effort. Lost updates are not retransmitted and subscribers
+// only keep the latest update.
+class multicast_publisher {
+ public:
+  explicit multicast_publisher(const char* service_name,
+                               const multicast_options& opts = {});
+  ~multicast_publisher();
+
+  multicast_publisher(const multicast_publisher&) = delete;
+  multicast_publisher& operator=(const multicast_publisher&) = delete;
+
+  // An update not sent yet is replaced by a newer one.
+  send_status send_update(const packet::payload& pl);
+
+ private:
+  void flush();
+  void io_ctx_thread_f();
+
+  multicast_options opts_;
+  // Announced by `publisher_`.
+  std::uint32_t epoch_;
+
+  discovery::publisher publisher_;
+
+  // IMPORTANT: The IO context MUST BE ran from one thread only, required for
+  // graceful shutdown to work. Use a strand if multiple threads are needed.
+  boost::asio::io_context io_ctx_;
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work_guard_ = boost::asio::make_work_guard(io_ctx_);
+  boost::asio::ip::udp::socket sock_{io_ctx_};
+  boost::asio::ip::udp::endpoint group_endpoint_;
+  std::thread io_ctx_thread_;
+
+  std::uint32_t next_update_seq_ = 0;
+
+  std::optional<packet::payload> pending_update_;
+  std::mutex pending_update_mtx_;
+};
+
+// Receives updates of a `multicast_publisher`, dropping any update older than
+// the latest received one, or sent by anyone else.
+class multicast_subscriber {
+ public:
+  explicit multicast_subscriber(const char* target_service_name,
+                                const multicast_options& opts = {});
+  ~multicast_subscriber();
+
+  multicast_subscriber(const multicast_subscriber&) = delete;
+  multicast_subscriber& operator=(const multicast_subscriber&) = delete;
+
+  packet::payload latest_update();
+
+ private:
+  boost::asio::awaitable<void> receive();
+  // Whether a discovered publisher announces `epoch`, e.g. after a restart.
+  bool is_announced(std::uint32_t epoch);
+  void io_ctx_thread_f();
+
+  multicast_options opts_;
+
+  discovery::browser browser_;
+
+  // IMPORTANT: The IO context MUST BE ran from one thread only, required for
+  // graceful shutdown to work. Use a strand if multiple threads are needed.
+  boost::asio::io_context io_ctx_;
+  boost::asio::ip::udp::socket sock_{io_ctx_};
+  std::thread io_ctx_thread_;
+
+  inbox inbox_;
+
+  bool shutdown_issued_ = false;
+};
+
+}  // namespace ircom
+
+#endif
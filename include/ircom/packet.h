@@ -25,6 +25,40 @@ const std::size_t FOOTER_SIZE = sizeof(FOOTER) - 1;  // Ignore null termination.
 const boost::asio::const_buffer FOOTER_BUF =
     boost::asio::buffer(FOOTER, FOOTER_SIZE);
 
+// Every frame is laid out as `HEADER`, a one byte `frame_type`, a type
+// specific body and then `FOOTER`.
+enum frame_type : std::uint8_t {
+  FRAME_UPDATE = 1,
+  FRAME_MESSAGE_CHUNK = 2,
+  // Answered with a `FRAME_PONG` carrying the same `probe`, such that the
+  // sender can tell the connection is alive and measure its round trip time.
+  FRAME_PING = 3,
+  FRAME_PONG = 4,
+};
+const std::size_t FRAME_TYPE_SIZE = 1;
+
+const std::size_t SEQUENCE_SIZE = 8;
+
+// Identifies a frame across every connection to the same peer. `epoch` is
+// picked randomly per sender instance such that a restarted sender is not
+// mistaken for a stale one. `number` increases by one per update.
+struct sequence {
+  std::uint32_t epoch;
+  std::uint32_t number;
+
+  void serialize(std::vector<std::uint8_t>& out) const;
+  void deserialize(const std::uint8_t* in);
+};
+
+// Whether `a` comes after `b` in serial number arithmetic, i.e. robust to
+// wraparound.
+inline bool is_after(std::uint32_t a, std::uint32_t b) {
+  return static_cast<std::int32_t>(a - b) > 0;
+}
+
+const std::size_t PAYLOAD_SIZE = 24;
+
+// Body of `FRAME_UPDATE`, preceded by a `sequence`.
 struct payload {
   double x;
   double y;
@@ -34,6 +68,45 @@ struct payload {
   void deserialize(const std::uint8_t* in);
 };
 
+const std::size_t UPDATE_FRAME_SIZE = HEADER_SIZE + FRAME_TYPE_SIZE +
+                                      SEQUENCE_SIZE + PAYLOAD_SIZE +
+                                      FOOTER_SIZE;
+
+// Messages are split into chunks of at most `MESSAGE_CHUNK_SIZE` bytes such
+// that a large message never holds the socket for long.
+const std::size_t MESSAGE_CHUNK_SIZE = 16 * 1024;
+const std::size_t MESSAGE_MAX_SIZE = 16 * 1024 * 1024;
+
+const std::size_t CHUNK_HEADER_SIZE = 20;
+
+// Body of `FRAME_MESSAGE_CHUNK`, followed by `size` bytes of message data.
+// Chunks of a message are sent in order and never interleaved with chunks of
+// another message. `epoch` is the one of the sender's `sequence`.
+struct chunk_header {
+  std::uint32_t epoch;
+  std::uint32_t message_id;
+  std::uint32_t message_size;
+  std::uint32_t offset;
+  std::uint32_t size;
+
+  void serialize(std::vector<std::uint8_t>& out) const;
+  void deserialize(const std::uint8_t* in);
+};
+
+const std::size_t PROBE_SIZE = 8;
+
+// Body of `FRAME_PING` and `FRAME_PONG`. `token` is only meaningful to the
+// sender of the ping.
+struct probe {
+  std::uint64_t token;
+
+  void serialize(std::vector<std::uint8_t>& out) const;
+  void deserialize(const std::uint8_t* in);
+};
+
+const std::size_t PROBE_FRAME_SIZE =
+    HEADER_SIZE + FRAME_TYPE_SIZE + PROBE_SIZE + FOOTER_SIZE;
+
 }  // namespace ircom::packet
 
 #endif
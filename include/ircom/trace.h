@@ -0,0 +1,101 @@
+#ifndef IRCOM_INCLUDE_IRCOM_TRACE_H_
+#define IRCOM_INCLUDE_IRCOM_TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Opt-in event tracing of discovery, connections, sends and receives. Events
+// go to a buffer owned by the recording thread, so recording takes no lock.
+// The trace is written as Chrome trace JSON, which both `chrome://tracing`
+// and the Perfetto UI open. Timestamps are from `std::chrono::steady_clock`,
+// i.e. CLOCK_MONOTONIC, so events line up with other traces of the same host
+// taken on that clock.
+//
+// Disabled by default, a trace point then costs one relaxed atomic load.
+namespace ircom::trace {
+
+// Events kept per thread, the oldest ones are overwritten once full.
+const std::size_t THREAD_BUFFER_CAP = 16384;
+
+namespace internal {
+
+struct event {
+  const char* category;
+  const char* name;
+  // Optional, names `arg`.
+  const char* arg_name;
+  std::int64_t arg;
+  std::int64_t start_ns;
+  // Negative for an instant event.
+  std::int64_t duration_ns;
+};
+
+extern std::atomic<bool> enabled;
+
+std::int64_t now_ns();
+void record(const event& ev);
+
+}  // namespace internal
+
+inline bool is_enabled() {
+  return internal::enabled.load(std::memory_order_relaxed);
+}
+
+// Discards previously recorded events and starts recording.
+void start();
+// Stops recording, returns once no thread is recording anymore.
+void stop();
+// Writes every recorded event. Recording is paused meanwhile.
+void write_chrome_json(std::ostream& out);
+// Names the calling thread in the trace.
+void set_thread_name(const char* name);
+
+// `category`, `name` and `arg_name` MUST BE string literals, or outlive the
+// trace otherwise.
+
+inline void instant(const char* category, const char* name,
+                    const char* arg_name = nullptr, std::int64_t arg = 0) {
+  if (!is_enabled()) return;
+  internal::record({
+      .category = category,
+      .name = name,
+      .arg_name = arg_name,
+      .arg = arg,
+      .start_ns = internal::now_ns(),
+      .duration_ns = -1,
+  });
+}
+
+// Records its lifetime as a span, e.g. a wait.
+class scope {
+ public:
+  scope(const char* category, const char* name, const char* arg_name = nullptr,
+        std::int64_t arg = 0)
+      : ev_({
+            .category = category,
+            .name = name,
+            .arg_name = arg_name,
+            .arg = arg,
+            .start_ns = is_enabled() ? internal::now_ns() : -1,
+        }) {}
+  ~scope() {
+    // Spans started while not tracing are not recorded.
+    if (ev_.start_ns < 0 || !is_enabled()) return;
+    ev_.duration_ns = internal::now_ns() - ev_.start_ns;
+    internal::record(ev_);
+  }
+
+  scope(const scope&) = delete;
+  scope& operator=(const scope&) = delete;
+
+  void set_arg(std::int64_t arg) { ev_.arg = arg; }
+
+ private:
+  internal::event ev_;
+};
+
+}  // namespace ircom::trace
+
+#endif
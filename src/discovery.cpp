@@ -3,22 +3,32 @@
 #include <cstring>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "avahi-common/address.h"
 #include "avahi-common/error.h"
 #include "boost/format.hpp"
 #include "ircom/config.h"
+#include "ircom/trace.h"
 #include "spdlog/spdlog.h"
 
 namespace ircom::discovery {
 
 // Should be the same as the protocol the server is listening over.
 const int DISCOVERY_RESOLVE_ADDR_PROTO = AVAHI_PROTO_INET;
-const char* const DISCOVERY_SERVICE_TYPE = "_ircom._tcp";
 
-publisher::publisher(const char* service_name) : service_name_(service_name) {
+publisher::publisher(const char* service_name, const char* service_type,
+                     std::uint16_t port, const std::vector<std::string>& txt)
+    : service_name_(service_name), service_type_(service_type), port_(port) {
+  for (const std::string& entry : txt)
+    txt_ = avahi_string_list_add(txt_, entry.c_str());
+
   ev_loop_ = avahi_threaded_poll_new();
-  if (!ev_loop_) throw std::runtime_error("Failed to create Avahi event loop");
+  if (!ev_loop_) {
+    avahi_string_list_free(txt_);
+    throw std::runtime_error("Failed to create Avahi event loop");
+  }
 
   mutex_ = internal::avahi_mutex(ev_loop_);
 
@@ -28,6 +38,7 @@ publisher::publisher(const char* service_name) : service_name_(service_name) {
                        client_callback, this, &error);
   if (!client_) {
     avahi_threaded_poll_free(ev_loop_);
+    avahi_string_list_free(txt_);
 
     throw std::runtime_error(
         (boost::format("Failed to create Avahi client: %1%") %
@@ -44,9 +55,11 @@ publisher::~publisher() {
   if (entry_group_) avahi_entry_group_free(entry_group_);
   avahi_client_free(client_);
   avahi_threaded_poll_free(ev_loop_);
+  avahi_string_list_free(txt_);
 }
 
 void publisher::publish() {
+  trace::scope span("discovery", "publish");
   std::unique_lock<internal::avahi_mutex> lock(mutex_);
   state_update_cv_.wait(lock, [&]() {
     return state_ == internal::publisher_state::PUBLISHER_CAN_PUBLISH ||
@@ -157,10 +170,10 @@ void publisher::publish_service_unlocked() {
   // Publish over all protocols for maximum coverage. With the default daemon
   // configuration, both IPv4 and IPv6 records are available over IPv4 queries;
   // IPv6 records are available over IPv6 queries.
-  int ret = avahi_entry_group_add_service(
+  int ret = avahi_entry_group_add_service_strlst(
       entry_group_, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC,
-      static_cast<AvahiPublishFlags>(0), service_name_, DISCOVERY_SERVICE_TYPE,
-      nullptr, nullptr, SERVICE_PORT, nullptr);
+      static_cast<AvahiPublishFlags>(0), service_name_, service_type_, nullptr,
+      nullptr, port_, txt_);
   if (ret == AVAHI_ERR_COLLISION) {
     // Local name collision handled here.
     // Remote name collision is handled in entry group callback.
@@ -192,8 +205,11 @@ void publisher::set_state_unlocked(internal::publisher_state state) {
   state_update_cv_.notify_all();
 }
 
-browser::browser(const char* target_service_name)
-    : target_service_name_(target_service_name) {
+browser::browser(const char* target_service_name, const char* service_type,
+                 std::uint16_t port)
+    : target_service_name_(target_service_name),
+      service_type_(service_type),
+      port_(port) {
   ev_loop_ = avahi_threaded_poll_new();
   if (!ev_loop_) throw std::runtime_error("Failed to create Avahi event loop");
 
@@ -217,9 +233,8 @@ browser::browser(const char* target_service_name)
   // IPv6 records are available over IPv6 queries. Address type are later
   // filtered when creating resolver.
   browser_ = avahi_service_browser_new(
-      client_, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, DISCOVERY_SERVICE_TYPE,
-      nullptr, static_cast<AvahiLookupFlags>(0), service_browser_callback,
-      this);
+      client_, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, service_type_, nullptr,
+      static_cast<AvahiLookupFlags>(0), service_browser_callback, this);
   if (!browser_) {
     avahi_client_free(client_);
     avahi_threaded_poll_free(ev_loop_);
@@ -242,6 +257,7 @@ browser::~browser() {
 }
 
 service_info browser::get_latest_service() {
+  trace::scope span("discovery", "get_latest_service");
   std::unique_lock<internal::avahi_mutex> lock(mutex_);
   new_service_cv_.wait(lock,
                        [&]() { return has_service_unlocked() || is_closed_; });
@@ -249,6 +265,12 @@ service_info browser::get_latest_service() {
   return services_.back();
 }
 
+std::vector<service_info> browser::get_services() {
+  std::lock_guard<internal::avahi_mutex> lock(mutex_);
+  if (is_closed_) throw closed_exception();
+  return services_;
+}
+
 void browser::close() {
   {
     std::unique_lock<internal::avahi_mutex> lock(mutex_);
@@ -272,27 +294,38 @@ void browser::service_resolver_callback(
   browser* self = static_cast<browser*>(data);
 
   switch (event) {
-    case AVAHI_RESOLVER_FOUND:
+    case AVAHI_RESOLVER_FOUND: {
       if (protocol != DISCOVERY_RESOLVE_ADDR_PROTO) break;
-      if (port != SERVICE_PORT) break;
+      if (port != self->port_) break;
 
       char addr_cstr[AVAHI_ADDRESS_STR_MAX];
       avahi_address_snprint(addr_cstr, AVAHI_ADDRESS_STR_MAX, addr);
 
+      std::vector<std::string> txt_entries;
+      for (AvahiStringList* entry = txt; entry;
+           entry = avahi_string_list_get_next(entry)) {
+        txt_entries.emplace_back(
+            reinterpret_cast<const char*>(avahi_string_list_get_text(entry)),
+            avahi_string_list_get_size(entry));
+      }
+
       self->services_.push_back({
           .interface = interface,
           .domain = domain,
           .addr = addr_cstr,
+          .txt = std::move(txt_entries),
       });
 
       self->new_service_cv_.notify_all();
 
+      trace::instant("discovery", "service_found", "interface", interface);
       spdlog::debug(
           "Found new service (name: {}, interface: {}, domain: {}, address: "
           "{})",
           name, interface, domain, addr_cstr);
 
       break;
+    }
 
     case AVAHI_RESOLVER_FAILURE:
       // The failure may not be fatal, e.g. when querying INET record over
@@ -318,7 +351,7 @@ void browser::service_browser_callback(
   switch (event) {
     case AVAHI_BROWSER_NEW:
       if (std::strcmp(name, self->target_service_name_) != 0) break;
-      if (std::strcmp(type, DISCOVERY_SERVICE_TYPE) != 0) break;
+      if (std::strcmp(type, self->service_type_) != 0) break;
 
       // Address type filter specified here.
       // Resolver is freed in the callback.
@@ -338,13 +371,15 @@ void browser::service_browser_callback(
 
     case AVAHI_BROWSER_REMOVE:
       if (std::strcmp(name, self->target_service_name_) != 0) break;
-      if (std::strcmp(type, DISCOVERY_SERVICE_TYPE) != 0) break;
+      if (std::strcmp(type, self->service_type_) != 0) break;
       if (protocol != DISCOVERY_RESOLVE_ADDR_PROTO) break;
 
       for (auto it = self->services_.begin(); it != self->services_.end();) {
         const service_info& service = *it;
         if (service.interface == interface && service.domain == domain) {
           it = self->services_.erase(it);
+          trace::instant("discovery", "service_removed", "interface",
+                         interface);
           spdlog::debug(
               "Removed service (name: {}, interface: {}, domain: {}, address: "
               "{})",
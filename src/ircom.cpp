@@ -1,103 +1,1198 @@
 #include "ircom/ircom.h"
 
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
 #include <array>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include "boost/system/system_error.hpp"
+#include "ircom/trace.h"
 #include "spdlog/spdlog.h"
 
 namespace ircom {
 
-void update_keeper::send_update(const packet::payload& pl) {
-  boost::asio::co_spawn(sock_.get_executor(), flush_queue(pl),
-                        boost::asio::detached);
+namespace {
+
+// Width of the window of message IDs remembered by `inbox`.
+const std::uint32_t MESSAGE_ID_WINDOW = 64;
+
+boost::system::system_error malformed_frame_error() {
+  return boost::system::system_error(
+      boost::system::errc::make_error_code(boost::system::errc::protocol_error),
+      "Malformed frame");
+}
+
+// Room for SCM_TIMESTAMPING along with IP_RECVERR or IPV6_RECVERR.
+const std::size_t TIMESTAMP_CONTROL_SIZE = 256;
+
+std::uint32_t timestamping_flags(latency::timestamping mode) {
+  // Every timestamp carries the byte offset of the frames it applies to, and
+  // not their data.
+  std::uint32_t flags = SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_SOFTWARE |
+                        SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  if (mode == latency::timestamping::hardware) {
+    flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+             SOF_TIMESTAMPING_RAW_HARDWARE;
+  } else {
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+  }
+  return flags;
 }
 
-packet::payload update_keeper::latest_update() {
-  std::lock_guard<std::mutex> lock(latest_update_mtx_);
+// Hardware timestamps take precedence, they are only reported if requested.
+std::chrono::system_clock::time_point timestamp_of(
+    const scm_timestamping& tss) {
+  const timespec& ts =
+      tss.ts[2].tv_sec != 0 || tss.ts[2].tv_nsec != 0 ? tss.ts[2] : tss.ts[0];
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::seconds(ts.tv_sec) +
+          std::chrono::nanoseconds(ts.tv_nsec)));
+}
+
+// Whether a timestamp of the bytes up to offset `id` covers a frame ending at
+// `end`, with both wrapping.
+bool is_covered(std::uint32_t end, std::uint32_t id) {
+  return static_cast<std::int32_t>(end - (id + 1)) <= 0;
+}
+
+// Keeps the owner of a sent message alive, and the message counted against
+// `MESSAGE_QUEUE_CAP`, until every copy of the message is released.
+class message_slot {
+ public:
+  message_slot(std::shared_ptr<internal::group_state> state,
+               std::shared_ptr<const void> owner)
+      : state_(std::move(state)), owner_(std::move(owner)) {}
+  ~message_slot() { --state_->messages_pending; }
+
+  message_slot(const message_slot&) = delete;
+  message_slot& operator=(const message_slot&) = delete;
+
+ private:
+  std::shared_ptr<internal::group_state> state_;
+  std::shared_ptr<const void> owner_;
+};
+
+// Same service instance, as seen on the same interface.
+bool is_same_instance(const discovery::service_info& a,
+                      const discovery::service_info& b) {
+  return a.interface == b.interface && a.addr == b.addr;
+}
+
+}  // namespace
+
+bool inbox::accept_update(const packet::sequence& seq,
+                          const packet::payload& pl) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (has_update_ && seq.epoch == latest_update_seq_.epoch &&
+      !packet::is_after(seq.number, latest_update_seq_.number))
+    return false;
+
+  has_update_ = true;
+  latest_update_seq_ = seq;
+  latest_update_ = pl;
+  return true;
+}
+
+packet::payload inbox::latest_update() {
+  std::lock_guard<std::mutex> lock(mtx_);
   return latest_update_;
 }
 
-boost::asio::awaitable<void> update_keeper::flush_queue(packet::payload pl) {
-  if (!sock_.is_open()) {
-    // To prevent updates from the last connection to be send to the new
-    // connection.
-    update_buf_.clear();
-    co_return;
+bool inbox::is_new_message(std::uint32_t epoch, std::uint32_t id) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return is_new_message_unlocked(epoch, id);
+}
+
+bool inbox::accept_message(std::uint32_t epoch, std::uint32_t id,
+                           message::buffer msg) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (!is_new_message_unlocked(epoch, id)) return false;
+
+  if (!has_message_ || epoch != message_epoch_) {
+    has_message_ = true;
+    message_epoch_ = epoch;
+    highest_message_id_ = id;
+    message_id_window_ = 1;
+  } else if (packet::is_after(id, highest_message_id_)) {
+    std::uint32_t shift = id - highest_message_id_;
+    message_id_window_ =
+        shift >= MESSAGE_ID_WINDOW ? 0 : message_id_window_ << shift;
+    message_id_window_ |= 1;
+    highest_message_id_ = id;
+  } else {
+    message_id_window_ |= std::uint64_t(1) << (highest_message_id_ - id);
+  }
+
+  if (messages_.size() == MESSAGE_INBOX_CAP) {
+    spdlog::warn("Inbound message queue full, dropping oldest message");
+    messages_.pop_front();
   }
+  messages_.push_back(std::move(msg));
+  return true;
+}
 
-  bool is_first = update_buf_.empty();
+std::optional<message::buffer> inbox::next_message() {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (messages_.empty()) return std::nullopt;
+
+  message::buffer msg = std::move(messages_.front());
+  messages_.pop_front();
+  return msg;
+}
+
+bool inbox::is_new_message_unlocked(std::uint32_t epoch, std::uint32_t id) {
+  if (!has_message_ || epoch != message_epoch_) return true;
+  if (packet::is_after(id, highest_message_id_)) return true;
+
+  // Too old to tell, treat as delivered.
+  std::uint32_t age = highest_message_id_ - id;
+  if (age >= MESSAGE_ID_WINDOW) return false;
+  return !(message_id_window_ & (std::uint64_t(1) << age));
+}
 
-  if (update_buf_.size() == update_buf_.capacity()) {
-    // Such that the active write loop knows whether to pop front or not.
-    update_buf_rotated_ = true;
+update_keeper::update_keeper(boost::asio::ip::tcp::socket sock, inbox& ib,
+                             std::function<void()> on_update_written,
+                             latency::recorder* latency)
+    : sock_(std::move(sock)),
+      inbox_(ib),
+      on_update_written_(std::move(on_update_written)),
+      rx_buf_(RECEIVE_BUF_SIZE),
+      latency_(latency) {}
+
+void update_keeper::configure_socket() {
+  // Updates are tiny and latency-sensitive, never hold them back to coalesce.
+  sock_.set_option(boost::asio::ip::tcp::no_delay(true));
+
+  // Makes the socket writable only while little is left unsent, which the
+  // write loop waits for before every bulk frame.
+  int lowat = BULK_NOTSENT_LOWAT;
+  if (::setsockopt(sock_.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   &lowat, sizeof(lowat)) != 0) {
     spdlog::warn(
-        "Outbound update buffer rotating, too many updates being dispatched");
+        "Failed to bound unsent bytes, urgent frames may wait behind bulk "
+        "frames: {}",
+        std::strerror(errno));
   }
-  update_buf_.push_back(pl);
 
-  if (!is_first) co_return;
+  if (latency_) {
+    // Set before anything is written, such that timestamp IDs are offsets
+    // from the start of the connection.
+    std::uint32_t flags = timestamping_flags(latency_->mode());
+    if (::setsockopt(sock_.native_handle(), SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                     sizeof(flags)) != 0) {
+      spdlog::warn("Failed to enable timestamping, not timestamping: {}",
+                   std::strerror(errno));
+      latency_ = nullptr;
+    }
+  }
+}
 
-  do {
-    // Make a copy here to prevent dangling reference/torn read as circular
-    // buffer overwrites the front.
-    packet::payload front = update_buf_.front();
+void update_keeper::enqueue_update(const internal::outbound_update& update,
+                                   lane ln) {
+  if (!is_active()) return;
 
-    std::vector<std::uint8_t> payload_bytes;
-    front.serialize(payload_bytes);
+  boost::circular_buffer<internal::outbound_update>& buf = lane_buf(ln);
+  if (buf.full()) {
+    // Only happens when this link is much slower than another link of the
+    // same group, as updates are otherwise held back by `link_group`.
+    spdlog::debug("Outbound {} update buffer of a link rotating",
+                  ln == lane::urgent ? "urgent" : "bulk");
+  }
+  buf.push_back(update);
+  wake_write_loop();
+}
 
-    std::array<boost::asio::const_buffer, 3> bufs = {
-        packet::HEADER_BUF,
-        boost::asio::buffer(payload_bytes),
-        packet::FOOTER_BUF,
-    };
+void update_keeper::enqueue_message(internal::outbound_message msg) {
+  if (!is_active()) return;
+
+  message_queue_.push_back(std::move(msg));
+  wake_write_loop();
+}
+
+void update_keeper::send_ping() {
+  if (!active_) return;
+
+  std::uint64_t token = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch())
+                            .count();
+  probe_queue_.push_back({.type = packet::FRAME_PING, .pr = {.token = token}});
+  wake_write_loop();
+}
+
+void update_keeper::wake_write_loop() {
+  if (!write_loop_active_) {
+    write_loop_active_ = true;
+    boost::asio::co_spawn(
+        sock_.get_executor(),
+        [self = shared_from_this()]() { return self->write_loop(); },
+        boost::asio::detached);
+  }
+}
+
+boost::asio::awaitable<void> update_keeper::write_loop() {
+  try {
+    // Strict priority: re-check the urgent lane before every frame, such that
+    // a burst of bulk frames is preempted as soon as an urgent frame arrives.
+    while (!probe_queue_.empty() || !urgent_buf_.empty() ||
+           !bulk_buf_.empty() || !message_queue_.empty()) {
+      if (!probe_queue_.empty()) {
+        co_await write_probes();
+        continue;
+      }
+      if (!urgent_buf_.empty()) {
+        // Urgent updates never wait behind each other, write them together.
+        co_await write_updates(urgent_buf_, urgent_buf_.size());
+        continue;
+      }
+
+      if (!is_bulk_writable()) {
+        if (!bulk_wait_active_) {
+          bulk_wait_active_ = true;
+          boost::asio::co_spawn(
+              sock_.get_executor(),
+              [self = shared_from_this()]() {
+                return self->wait_bulk_writable();
+              },
+              boost::asio::detached);
+        }
+        break;
+      }
+
+      bool take_message = !message_queue_.empty() &&
+                          (bulk_buf_.empty() || bulk_prefer_message_);
+      bulk_prefer_message_ = !take_message;
+      if (take_message) {
+        co_await write_message_chunk();
+      } else {
+        co_await write_updates(bulk_buf_, 1);
+      }
+    }
+  } catch (const boost::system::system_error& err) {
+    // The read loop owns the connection lifecycle, only drop what is queued.
+    spdlog::debug("Failed to write frame, dropping queued frames: {}",
+                  err.what());
+    clear_outbound();
+  }
+
+  write_loop_active_ = false;
+}
+
+boost::asio::awaitable<void> update_keeper::write_updates(
+    boost::circular_buffer<internal::outbound_update>& buf,
+    std::size_t max_count) {
+  // Pop before writing such that rotation while the write is pending never
+  // touches the frames in flight.
+  tx_updates_.clear();
+  tx_buf_.clear();
+  for (; max_count > 0 && !buf.empty(); --max_count) {
+    const internal::outbound_update& update = buf.front();
+    tx_buf_.insert(tx_buf_.end(), packet::HEADER,
+                   packet::HEADER + packet::HEADER_SIZE);
+    tx_buf_.push_back(packet::FRAME_UPDATE);
+    update.seq.serialize(tx_buf_);
+    update.pl.serialize(tx_buf_);
+    tx_buf_.insert(tx_buf_.end(), packet::FOOTER,
+                   packet::FOOTER + packet::FOOTER_SIZE);
+
+    tx_updates_.push_back(std::move(buf.front()));
+    buf.pop_front();
+  }
+
+  if (latency_) {
+    std::chrono::system_clock::time_point now =
+        std::chrono::system_clock::now();
+    for (const internal::outbound_update& update : tx_updates_) {
+      latency_->record(latency::stage::queueing, now - update.submitted_at);
+      tx_bytes_ += packet::UPDATE_FRAME_SIZE;
+      awaiting_sent_.push_back({.end = tx_bytes_, .at = now});
+    }
+    while (awaiting_sent_.size() > TX_TIMESTAMP_BACKLOG_CAP)
+      awaiting_sent_.pop_front();
+  }
+
+  {
+    // Long spans show the socket backing up.
+    trace::scope span("send", "write_updates", "count", tx_updates_.size());
+    co_await boost::asio::async_write(sock_, boost::asio::buffer(tx_buf_),
+                                      boost::asio::use_awaitable);
+  }
+  if (latency_) collect_tx_timestamps();
+
+  for (internal::outbound_update& update : tx_updates_) {
+    if (update.dl) update.dl->complete(true);
+    if (on_update_written_) on_update_written_();
+  }
+  tx_updates_.clear();
+}
 
+bool update_keeper::is_bulk_writable() {
+  // Unlike a write, polling respects TCP_NOTSENT_LOWAT.
+  pollfd pfd = {.fd = sock_.native_handle(), .events = POLLOUT, .revents = 0};
+  // Errors are left to the next write.
+  return ::poll(&pfd, 1, 0) != 0;
+}
+
+boost::asio::awaitable<void> update_keeper::wait_bulk_writable() {
+  boost::system::error_code ec;
+  {
+    // Long spans show the peer reading slower than bulk frames are sent.
+    trace::scope span("send", "wait_bulk_writable");
+    co_await sock_.async_wait(
+        boost::asio::ip::tcp::socket::wait_write,
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+  }
+  bulk_wait_active_ = false;
+  if (ec) {
+    // Waiting again would fail alike, e.g. once the socket is closed.
+    spdlog::debug("Failed to wait for socket, dropping queued bulk frames: {}",
+                  ec.message());
+    bulk_buf_.clear();
+    message_queue_.clear();
+    co_return;
+  }
+  wake_write_loop();
+}
+
+boost::asio::awaitable<void> update_keeper::write_probes() {
+  tx_buf_.clear();
+  tx_buf_.reserve(probe_queue_.size() * packet::PROBE_FRAME_SIZE);
+  for (const internal::outbound_probe& probe : probe_queue_) {
+    tx_buf_.insert(tx_buf_.end(), packet::HEADER,
+                   packet::HEADER + packet::HEADER_SIZE);
+    tx_buf_.push_back(probe.type);
+    probe.pr.serialize(tx_buf_);
+    tx_buf_.insert(tx_buf_.end(), packet::FOOTER,
+                   packet::FOOTER + packet::FOOTER_SIZE);
+  }
+  probe_queue_.clear();
+
+  if (latency_) tx_bytes_ += tx_buf_.size();
+  co_await boost::asio::async_write(sock_, boost::asio::buffer(tx_buf_),
+                                    boost::asio::use_awaitable);
+}
+
+boost::asio::awaitable<void> update_keeper::write_message_chunk() {
+  internal::outbound_message& msg = message_queue_.front();
+  std::uint32_t id = msg.id;
+  std::size_t chunk_size =
+      std::min(packet::MESSAGE_CHUNK_SIZE, msg.data.size() - msg.offset);
+
+  packet::chunk_header header = {
+      .epoch = msg.epoch,
+      .message_id = id,
+      .message_size = static_cast<std::uint32_t>(msg.data.size()),
+      .offset = static_cast<std::uint32_t>(msg.offset),
+      .size = static_cast<std::uint32_t>(chunk_size),
+  };
+  std::vector<std::uint8_t> header_bytes;
+  header_bytes.push_back(packet::FRAME_MESSAGE_CHUNK);
+  header.serialize(header_bytes);
+
+  // The chunk data is written straight from the user buffer.
+  std::array<boost::asio::const_buffer, 4> bufs = {
+      packet::HEADER_BUF,
+      boost::asio::buffer(header_bytes),
+      boost::asio::buffer(msg.data + msg.offset, chunk_size),
+      packet::FOOTER_BUF,
+  };
+
+  // Only counted such that timestamps of later updates line up.
+  if (latency_) tx_bytes_ += boost::asio::buffer_size(bufs);
+  {
+    trace::scope span("send", "write_message_chunk", "bytes", chunk_size);
     co_await boost::asio::async_write(sock_, bufs, boost::asio::use_awaitable);
+  }
 
-    // If rotated, don't pop front as the front is no longer the same.
-    // Reset "rotated" flag afterwards.
-    if (!update_buf_rotated_) update_buf_.pop_front();
-    update_buf_rotated_ = false;
-  } while (!update_buf_.empty());
+  // The queue may have been cleared while the write was pending.
+  if (message_queue_.empty() || message_queue_.front().id != id) co_return;
+  internal::outbound_message& written = message_queue_.front();
+  written.offset += chunk_size;
+  if (written.offset == written.data.size()) message_queue_.pop_front();
 }
 
 boost::asio::awaitable<void> update_keeper::handle_updates() {
+  active_ = true;
+  last_received_at_ = std::chrono::steady_clock::now();
+  rx_begin_ = 0;
+  rx_end_ = 0;
+  try {
+    // Frames are decoded straight from the receive buffer, every frame already
+    // received is handled without another read.
+    while (true) {
+      co_await fill(packet::HEADER_SIZE + packet::FRAME_TYPE_SIZE);
+      const std::uint8_t* prefix = rx_buf_.data() + rx_begin_;
+      if (std::memcmp(prefix, packet::HEADER, packet::HEADER_SIZE) != 0)
+        throw malformed_frame_error();
+      std::uint8_t type = prefix[packet::HEADER_SIZE];
+      rx_begin_ += packet::HEADER_SIZE + packet::FRAME_TYPE_SIZE;
+
+      switch (type) {
+        case packet::FRAME_UPDATE: {
+          const std::size_t body_size =
+              packet::SEQUENCE_SIZE + packet::PAYLOAD_SIZE +
+              packet::FOOTER_SIZE;
+          co_await fill(body_size);
+          const std::uint8_t* body = rx_buf_.data() + rx_begin_;
+          if (std::memcmp(body + packet::SEQUENCE_SIZE + packet::PAYLOAD_SIZE,
+                          packet::FOOTER, packet::FOOTER_SIZE) != 0)
+            throw malformed_frame_error();
+
+          packet::sequence seq;
+          seq.deserialize(body);
+          packet::payload pl;
+          pl.deserialize(body + packet::SEQUENCE_SIZE);
+          rx_begin_ += body_size;
+
+          if (latency_ && rx_timestamp_.time_since_epoch().count() != 0) {
+            latency_->record(latency::stage::receive,
+                             std::chrono::system_clock::now() - rx_timestamp_);
+          }
+          if (standby_) break;
+          trace::instant("receive", "update", "seq", seq.number);
+          inbox_.accept_update(seq, pl);
+          break;
+        }
+
+        case packet::FRAME_MESSAGE_CHUNK:
+          co_await receive_chunk();
+          break;
+
+        case packet::FRAME_PING:
+        case packet::FRAME_PONG: {
+          const std::size_t body_size =
+              packet::PROBE_SIZE + packet::FOOTER_SIZE;
+          co_await fill(body_size);
+          const std::uint8_t* body = rx_buf_.data() + rx_begin_;
+          if (std::memcmp(body + packet::PROBE_SIZE, packet::FOOTER,
+                          packet::FOOTER_SIZE) != 0)
+            throw malformed_frame_error();
+
+          packet::probe probe;
+          probe.deserialize(body);
+          rx_begin_ += body_size;
+
+          if (type == packet::FRAME_PING) {
+            probe_queue_.push_back({.type = packet::FRAME_PONG, .pr = probe});
+            wake_write_loop();
+          } else {
+            round_trip_time_ =
+                std::chrono::steady_clock::now().time_since_epoch() -
+                std::chrono::nanoseconds(probe.token);
+          }
+          break;
+        }
+
+        default:
+          throw malformed_frame_error();
+      }
+    }
+  } catch (...) {
+    active_ = false;
+    clear_outbound();
+    // Partial messages of this connection are never completed.
+    reassembly_.reset();
+    throw;
+  }
+}
+
+boost::asio::awaitable<void> update_keeper::fill(std::size_t size) {
+  if (rx_end_ - rx_begin_ >= size) co_return;
+
+  // Only a partial frame is left, cheap to move.
+  std::memmove(rx_buf_.data(), rx_buf_.data() + rx_begin_, rx_end_ - rx_begin_);
+  rx_end_ -= rx_begin_;
+  rx_begin_ = 0;
+
+  while (rx_end_ < size) {
+    if (latency_) {
+      rx_end_ += co_await read_some_timestamped(boost::asio::buffer(rx_buf_) +
+                                                rx_end_);
+    } else {
+      rx_end_ += co_await sock_.async_read_some(
+          boost::asio::buffer(rx_buf_) + rx_end_, boost::asio::use_awaitable);
+    }
+    last_received_at_ = std::chrono::steady_clock::now();
+  }
+}
+
+boost::asio::awaitable<std::size_t> update_keeper::read_some_timestamped(
+    boost::asio::mutable_buffer buf) {
+  iovec iov = {.iov_base = buf.data(), .iov_len = buf.size()};
+  std::array<char, TIMESTAMP_CONTROL_SIZE> control;
+  while (true) {
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t size = ::recvmsg(sock_.native_handle(), &msg, MSG_DONTWAIT);
+    if (size == 0) throw boost::system::system_error(boost::asio::error::eof);
+    if (size < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        throw boost::system::system_error(
+            errno, boost::asio::error::get_system_category());
+      }
+      // Pending TX timestamps wake up the wait, as an error condition.
+      collect_tx_timestamps();
+      co_await sock_.async_wait(boost::asio::ip::tcp::socket::wait_read,
+                                boost::asio::use_awaitable);
+      continue;
+    }
+
+    // Covers the last received segment.
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+        rx_timestamp_ = timestamp_of(
+            *reinterpret_cast<const scm_timestamping*>(CMSG_DATA(cm)));
+      }
+    }
+    co_return static_cast<std::size_t>(size);
+  }
+}
+
+void update_keeper::collect_tx_timestamps() {
+  std::array<char, TIMESTAMP_CONTROL_SIZE> control;
+  while (true) {
+    msghdr msg = {};
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    if (::recvmsg(sock_.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) <
+        0)
+      return;
+
+    const scm_timestamping* tss = nullptr;
+    const sock_extended_err* serr = nullptr;
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+        tss = reinterpret_cast<const scm_timestamping*>(CMSG_DATA(cm));
+      } else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR)) {
+        serr = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+      }
+    }
+    if (!tss || !serr || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) continue;
+
+    std::chrono::system_clock::time_point at = timestamp_of(*tss);
+    if (serr->ee_info == SCM_TSTAMP_SND) {
+      while (!awaiting_sent_.empty() &&
+             is_covered(awaiting_sent_.front().end, serr->ee_data)) {
+        internal::written_frame frame = awaiting_sent_.front();
+        awaiting_sent_.pop_front();
+        latency_->record(latency::stage::kernel_send, at - frame.at);
+        awaiting_acked_.push_back({.end = frame.end, .at = at});
+      }
+      while (awaiting_acked_.size() > TX_TIMESTAMP_BACKLOG_CAP)
+        awaiting_acked_.pop_front();
+    } else if (serr->ee_info == SCM_TSTAMP_ACK) {
+      while (!awaiting_acked_.empty() &&
+             is_covered(awaiting_acked_.front().end, serr->ee_data)) {
+        latency_->record(latency::stage::network_round_trip,
+                         at - awaiting_acked_.front().at);
+        awaiting_acked_.pop_front();
+      }
+    }
+  }
+}
+
+boost::asio::awaitable<void> update_keeper::receive_chunk() {
+  co_await fill(packet::CHUNK_HEADER_SIZE);
+  packet::chunk_header header;
+  header.deserialize(rx_buf_.data() + rx_begin_);
+  rx_begin_ += packet::CHUNK_HEADER_SIZE;
+
+  if (header.size > packet::MESSAGE_CHUNK_SIZE ||
+      header.message_size > packet::MESSAGE_MAX_SIZE ||
+      header.offset > header.message_size ||
+      header.size > header.message_size - header.offset)
+    throw malformed_frame_error();
+
+  if (header.offset == 0) {
+    if (reassembly_) {
+      // The sender dropped the rest of the previous message.
+      spdlog::warn("Discarding incomplete message {}", reassembly_id_);
+      reassembly_.reset();
+    }
+    // Skip messages already delivered over another connection.
+    if (!standby_ && inbox_.is_new_message(header.epoch, header.message_id)) {
+      reassembly_ = message_pool_.acquire(header.message_size);
+      reassembly_epoch_ = header.epoch;
+      reassembly_id_ = header.message_id;
+      reassembly_received_ = 0;
+    }
+  }
+
+  // Chunks arrive in order, anything else belongs to a discarded message.
+  bool is_expected = reassembly_ && header.epoch == reassembly_epoch_ &&
+                     header.message_id == reassembly_id_ &&
+                     header.offset == reassembly_received_;
+  boost::asio::mutable_buffer dest;
+  if (is_expected) {
+    dest = boost::asio::buffer(reassembly_->data() + header.offset,
+                               header.size);
+  } else {
+    discard_buf_.resize(header.size);
+    dest = boost::asio::buffer(discard_buf_);
+  }
+
+  // Data already received is copied, the rest is read in place along with
+  // whatever follows the chunk.
+  std::size_t buffered = std::min<std::size_t>(rx_end_ - rx_begin_,
+                                               header.size);
+  std::memcpy(dest.data(), rx_buf_.data() + rx_begin_, buffered);
+  rx_begin_ += buffered;
+  if (buffered < header.size) {
+    rx_begin_ = 0;
+    rx_end_ = 0;
+    if (latency_) {
+      // Whatever follows is read through `fill`, which takes RX timestamps.
+      co_await boost::asio::async_read(sock_, dest + buffered,
+                                       boost::asio::use_awaitable);
+    } else {
+      std::array<boost::asio::mutable_buffer, 2> bufs = {
+          dest + buffered,
+          boost::asio::buffer(rx_buf_),
+      };
+      std::size_t size = co_await boost::asio::async_read(
+          sock_, bufs, boost::asio::transfer_at_least(header.size - buffered),
+          boost::asio::use_awaitable);
+      rx_end_ = size - (header.size - buffered);
+    }
+    last_received_at_ = std::chrono::steady_clock::now();
+  }
+
+  co_await fill(packet::FOOTER_SIZE);
+  if (std::memcmp(rx_buf_.data() + rx_begin_, packet::FOOTER,
+                  packet::FOOTER_SIZE) != 0)
+    throw malformed_frame_error();
+  rx_begin_ += packet::FOOTER_SIZE;
+
+  if (!is_expected) co_return;
+
+  reassembly_received_ += header.size;
+  if (reassembly_received_ < header.message_size) co_return;
+
+  trace::instant("receive", "message", "id", reassembly_id_);
+  inbox_.accept_message(reassembly_epoch_, reassembly_id_,
+                        std::move(*reassembly_));
+  reassembly_.reset();
+}
+
+boost::circular_buffer<internal::outbound_update>& update_keeper::lane_buf(
+    lane ln) {
+  return ln == lane::urgent ? urgent_buf_ : bulk_buf_;
+}
+
+void update_keeper::clear_outbound() {
+  // To prevent frames from the last connection to be send to the new
+  // connection.
+  probe_queue_.clear();
+  urgent_buf_.clear();
+  bulk_buf_.clear();
+  message_queue_.clear();
+}
+
+namespace internal {
+
+group_state::group_state(latency::timestamping timestamping)
+    : recorder(timestamping), epoch(std::random_device()()) {}
+
+std::shared_ptr<const void> admit_message(
+    const std::shared_ptr<group_state>& state, boost::asio::const_buffer data,
+    std::shared_ptr<const void> owner) {
+  if (data.size() > packet::MESSAGE_MAX_SIZE)
+    throw std::invalid_argument("Message too large");
+
+  if (state->messages_pending.fetch_add(1) >= MESSAGE_QUEUE_CAP) {
+    --state->messages_pending;
+    trace::instant("send", "message_dropped");
+    return nullptr;
+  }
+  return std::make_shared<message_slot>(state, std::move(owner));
+}
+
+}  // namespace internal
+
+link_group::link_group(boost::asio::io_context& io_ctx,
+                       const send_options& opts,
+                       latency::timestamping timestamping)
+    : link_group(io_ctx, std::make_shared<internal::group_state>(timestamping),
+                 opts) {}
+
+link_group::link_group(boost::asio::io_context& io_ctx,
+                       std::shared_ptr<internal::group_state> state,
+                       const send_options& opts)
+    : io_ctx_(io_ctx),
+      opts_(opts),
+      state_(std::move(state)),
+      dispatch_timer_(io_ctx),
+      tokens_(static_cast<double>(opts.burst)),
+      tokens_refilled_at_(std::chrono::steady_clock::now()) {}
+
+send_status link_group::send_update(const packet::payload& pl, lane ln) {
+  return admit({.pl = pl}, ln);
+}
+
+send_receipt link_group::send_update_tracked(const packet::payload& pl,
+                                             lane ln) {
+  std::shared_ptr<internal::delivery> dl =
+      std::make_shared<internal::delivery>();
+  std::future<bool> written = dl->get_future();
+  send_status status = admit({.pl = pl, .dl = std::move(dl)}, ln);
+  return {.status = status, .written = std::move(written)};
+}
+
+send_status link_group::send_numbered_update(
+    std::uint32_t number, const packet::payload& pl, lane ln,
+    std::shared_ptr<internal::delivery> dl) {
+  return admit({.pl = pl, .dl = std::move(dl), .number = number}, ln);
+}
+
+send_status link_group::admit(internal::pending_update update, lane ln) {
+  // Updates are never carried over to a later connection.
+  if (active_links_ == 0) {
+    trace::instant("send", "update_dropped");
+    return send_status::dropped;
+  }
+
+  std::atomic<std::size_t>& pending =
+      ln == lane::urgent ? urgent_pending_ : bulk_pending_;
+  bounded_queue<internal::submitted_update, SUBMISSION_QUEUE_CAP>& submissions =
+      ln == lane::urgent ? urgent_submissions_ : bulk_submissions_;
+
+  bool overflowed = pending.fetch_add(1) >= UPDATE_BUF_CAP;
+  if (overflowed) {
+    // The update takes the place of a queued one, if any.
+    --pending;
+    if (opts_.overflow == overflow_policy::drop_newest) {
+      trace::instant("send", "update_dropped");
+      return send_status::dropped;
+    }
+  }
+
+  internal::submitted_update sub = {
+      .pl = update.pl,
+      .dl = std::move(update.dl),
+      .submitted_at = state_->recorder.mode() != latency::timestamping::off
+                          ? std::chrono::system_clock::now()
+                          : std::chrono::system_clock::time_point(),
+      .number = update.number,
+      .overflowed = overflowed,
+  };
+  while (!submissions.try_push(std::move(sub))) {
+    // The IO context thread is far behind, e.g. while waiting for the links.
+    // Only reached with `drop_oldest` or `conflate` since the lane bounds the
+    // submissions otherwise.
+    internal::submitted_update evicted;
+    if (submissions.try_pop(evicted) && !evicted.overflowed) --pending;
+    overflowed = true;
+  }
+
+  if (!dispatch_scheduled_.exchange(true))
+    boost::asio::co_spawn(io_ctx_, dispatch_loop(), boost::asio::detached);
+  else if (ln == lane::urgent && bulk_held_.exchange(false))
+    boost::asio::post(io_ctx_, [this]() { wake_dispatcher(); });
+  // Only the IO context thread knows whether something is replaced, see
+  // `send_status::conflated`.
+  return overflowed && opts_.overflow == overflow_policy::conflate
+             ? send_status::conflated
+             : send_status::queued;
+}
+
+void link_group::drain_submissions() {
+  drain_submissions(lane::urgent);
+  drain_submissions(lane::bulk);
+}
+
+void link_group::drain_submissions(lane ln) {
+  bounded_queue<internal::submitted_update, SUBMISSION_QUEUE_CAP>& submissions =
+      ln == lane::urgent ? urgent_submissions_ : bulk_submissions_;
+  std::atomic<std::size_t>& pending =
+      ln == lane::urgent ? urgent_pending_ : bulk_pending_;
+  boost::circular_buffer<internal::pending_update>& buf =
+      ln == lane::urgent ? urgent_buf_ : bulk_buf_;
+
+  internal::submitted_update sub;
+  while (submissions.try_pop(sub)) {
+    internal::pending_update update = {
+        .pl = sub.pl,
+        .dl = std::move(sub.dl),
+        .submitted_at = sub.submitted_at,
+        .number = sub.number,
+    };
+    if (!buf.full()) {
+      // The lane has been drained since the overflow was detected.
+      if (sub.overflowed) ++pending;
+      buf.push_back(std::move(update));
+    } else if (sub.overflowed &&
+               opts_.overflow == overflow_policy::conflate) {
+      buf.back() = std::move(update);
+    } else {
+      spdlog::warn(
+          "Outbound {} update buffer rotating, too many updates being "
+          "dispatched",
+          ln == lane::urgent ? "urgent" : "bulk");
+      // Counted when submitted, but the oldest one is dropped in its place.
+      if (!sub.overflowed) --pending;
+      buf.push_back(std::move(update));
+    }
+  }
+}
+
+boost::asio::awaitable<void> link_group::dispatch_loop() {
   while (true) {
-    std::uint8_t buf[5 + 24 + 3];
-    co_await boost::asio::async_read(sock_,
-                                     boost::asio::buffer(buf, 5 + 24 + 3),
-                                     boost::asio::use_awaitable);
+    drain_submissions();
+    if (closed_ || urgent_buf_.empty() && bulk_buf_.empty()) {
+      // Synchronizes with `admit`: either the submission pushed before the
+      // flag is cleared is visible here, or its sender spawns a new loop.
+      dispatch_scheduled_.exchange(false);
+      if (closed_ ||
+          urgent_submissions_.empty() && bulk_submissions_.empty() ||
+          dispatch_scheduled_.exchange(true))
+        co_return;
+      continue;
+    }
+
+    // Wait before picking the update, such that conflation keeps replacing
+    // the one about to be sent.
+    for (std::chrono::steady_clock::duration delay = dispatch_delay();
+         delay > std::chrono::steady_clock::duration::zero() && !closed_;
+         delay = dispatch_delay()) {
+      dispatch_timer_.expires_after(delay);
+      boost::system::error_code ec;
+      co_await dispatch_timer_.async_wait(
+          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+    waiting_for_link_ = false;
+    bulk_held_ = false;
+    if (closed_) continue;
+    drain_submissions();
+
+    lane ln = urgent_buf_.empty() ? lane::bulk : lane::urgent;
+    boost::circular_buffer<internal::pending_update>& buf =
+        ln == lane::urgent ? urgent_buf_ : bulk_buf_;
+    internal::pending_update next = std::move(buf.front());
+    buf.pop_front();
+    --(ln == lane::urgent ? urgent_pending_ : bulk_pending_);
+    if (opts_.max_updates_per_sec > 0) tokens_ -= 1;
+
+    // Numbered here such that numbers follow the order updates are actually
+    // sent in.
+    internal::outbound_update update = {
+        .seq = {.epoch = state_->epoch,
+                .number = next.number ? *next.number
+                                      : state_->next_update_seq++},
+        .pl = next.pl,
+        .dl = std::move(next.dl),
+        .submitted_at = next.submitted_at,
+    };
+    trace::instant("send", "update_dispatched", "seq", update.seq.number);
+    for (const std::shared_ptr<update_keeper>& keeper : links_)
+      keeper->enqueue_update(update, ln);
+  }
+}
+
+std::chrono::steady_clock::duration link_group::dispatch_delay() {
+  if (opts_.max_updates_per_sec > 0) {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - tokens_refilled_at_;
+    tokens_ = std::min(static_cast<double>(opts_.burst),
+                       tokens_ + elapsed.count() * opts_.max_updates_per_sec);
+    tokens_refilled_at_ = now;
+
+    if (tokens_ < 1) {
+      return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>((1 - tokens_) /
+                                        opts_.max_updates_per_sec));
+    }
+  }
 
-    packet::payload pl;
-    pl.deserialize(buf + 5);
+  // Each lane is held back only by its own backlog, such that a link busy
+  // with bulk updates still takes urgent ones.
+  drain_submissions(lane::urgent);
+  lane ln = urgent_buf_.empty() ? lane::bulk : lane::urgent;
+  // Without any active link the update is dropped right away.
+  bool can_hand_over =
+      std::none_of(links_.begin(), links_.end(),
+                   [](const std::shared_ptr<update_keeper>& keeper) {
+                     return keeper->is_active();
+                   }) ||
+      std::any_of(links_.begin(), links_.end(),
+                  [ln](const std::shared_ptr<update_keeper>& keeper) {
+                    return keeper->is_active() &&
+                           keeper->update_backlog(ln) < LINK_BACKLOG_CAP;
+                  });
+  if (can_hand_over) return std::chrono::steady_clock::duration::zero();
 
-    {
-      std::lock_guard<std::mutex> lock(latest_update_mtx_);
-      latest_update_ = pl;
+  // Woken up by `wake_dispatcher`.
+  waiting_for_link_ = true;
+  if (ln == lane::bulk) {
+    // Synchronizes with `admit`: either an urgent update submitted before the
+    // flag is set is visible here, or its sender wakes the dispatcher.
+    bulk_held_.exchange(true);
+    if (!urgent_submissions_.empty()) {
+      bulk_held_ = false;
+      return dispatch_delay();
     }
   }
+  return std::chrono::steady_clock::duration::max();
 }
 
-server::server(const char* service_name) : publisher_(service_name) {
+void link_group::wake_dispatcher() {
+  if (waiting_for_link_) dispatch_timer_.cancel();
+}
+
+packet::payload link_group::latest_update() {
+  return state_->ib.latest_update();
+}
+
+send_status link_group::send_message(boost::asio::const_buffer data,
+                                     std::shared_ptr<const void> owner) {
+  std::shared_ptr<const void> slot =
+      internal::admit_message(state_, data, std::move(owner));
+  if (!slot) return send_status::dropped;
+  return send_numbered_message(state_->next_message_id++, data,
+                               std::move(slot));
+}
+
+send_status link_group::send_numbered_message(
+    std::uint32_t id, boost::asio::const_buffer data,
+    std::shared_ptr<const void> owner) {
+  // Messages are never carried over to a later connection.
+  if (active_links_ == 0) {
+    trace::instant("send", "message_dropped");
+    return send_status::dropped;
+  }
+
+  boost::asio::post(io_ctx_, [this, id, data, owner = std::move(owner)]() {
+    internal::outbound_message msg = {
+        .epoch = state_->epoch,
+        .id = id,
+        .data = data,
+        .owner = owner,
+    };
+    for (const std::shared_ptr<update_keeper>& keeper : links_)
+      keeper->enqueue_message(msg);
+  });
+  return send_status::queued;
+}
+
+std::optional<message::buffer> link_group::next_message() {
+  return state_->ib.next_message();
+}
+
+latency::breakdown link_group::latency_breakdown() {
+  return state_->recorder.snapshot();
+}
+
+std::shared_ptr<update_keeper> link_group::make_link() {
+  return make_link(boost::asio::ip::tcp::socket(io_ctx_));
+}
+
+std::shared_ptr<update_keeper> link_group::make_link(
+    boost::asio::ip::tcp::socket sock) {
+  std::shared_ptr<update_keeper> keeper = std::make_shared<update_keeper>(
+      std::move(sock), state_->ib, [this]() { wake_dispatcher(); },
+      state_->recorder.mode() != latency::timestamping::off ? &state_->recorder
+                                                            : nullptr);
+  links_.push_back(keeper);
+  return keeper;
+}
+
+void link_group::remove(const std::shared_ptr<update_keeper>& keeper) {
+  keeper->socket().close();
+  std::erase(links_, keeper);
+  wake_dispatcher();
+}
+
+void link_group::set_standby(const std::shared_ptr<update_keeper>& keeper,
+                             bool standby) {
+  keeper->set_standby(standby);
+  wake_dispatcher();
+}
+
+boost::asio::awaitable<bool> link_group::serve(
+    std::shared_ptr<update_keeper> keeper) {
+  // E.g. a connection handed over from another thread during shutdown.
+  if (closed_) {
+    remove(keeper);
+    co_return false;
+  }
+
+  bool is_open = true;
+  ++active_links_;
+  // The dispatcher resumes once `handle_updates` suspended, with the link
+  // active.
+  wake_dispatcher();
+  trace::scope span("connect", "connection");
+  try {
+    keeper->configure_socket();
+    co_await keeper->handle_updates();
+  } catch (const boost::system::system_error& err) {
+    // Once closed, any error (e.g. reading from the closed socket) is part of
+    // the shutdown.
+    if (err.code() == boost::asio::error::operation_aborted || closed_) {
+      spdlog::info("Ongoing communication shut down");
+      is_open = false;
+    } else if (err.code() == boost::asio::error::eof) {
+      // E.g. a latency probe of the peer, or the link expired.
+      spdlog::info("Connection closed, discarding connection");
+    } else {
+      trace::instant("connect", "connection_failed");
+      spdlog::error(
+          "An error occurred for the connection, discarding connection: {}",
+          err.what());
+    }
+  }
+  --active_links_;
+
+  remove(keeper);
+  co_return is_open && !closed_;
+}
+
+void link_group::ping_links(
+    std::chrono::steady_clock::duration silence_limit) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  for (const std::shared_ptr<update_keeper>& keeper : links_) {
+    if (!keeper->is_connected()) continue;
+
+    if (now - keeper->last_received_at() > silence_limit) {
+      spdlog::warn("Nothing received for {} ms, shutting down connection",
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       now - keeper->last_received_at())
+                       .count());
+      trace::instant("connect", "link_expired");
+      // Ends `handle_updates` like the peer closing the connection would.
+      boost::system::error_code ec;
+      keeper->socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both,
+                                ec);
+      continue;
+    }
+    keeper->send_ping();
+  }
+}
+
+void link_group::close_all() {
+  closed_ = true;
+  dispatch_timer_.cancel();
+  drain_submissions();
+  urgent_buf_.clear();
+  bulk_buf_.clear();
+  urgent_pending_ = 0;
+  bulk_pending_ = 0;
+  for (const std::shared_ptr<update_keeper>& keeper : links_)
+    keeper->socket().close();
+}
+
+server::server(const char* service_name, const server_options& opts)
+    : publisher_(service_name, discovery::DISCOVERY_SERVICE_TYPE, opts.port),
+      acceptor_(io_ctx_, boost::asio::ip::tcp::endpoint(
+                             boost::asio::ip::tcp::v4(), opts.port)),
+      state_(std::make_shared<internal::group_state>(opts.timestamping)),
+      links_(io_ctx_, state_, opts.send) {
+  std::size_t threads =
+      opts.threads > 0
+          ? opts.threads
+          : std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  for (std::size_t i = 1; i < threads; ++i) {
+    shards_.push_back(
+        std::make_unique<internal::server_shard>(state_, opts.send));
+    internal::server_shard& shard = *shards_.back();
+    shard.thread = std::thread([&shard]() {
+      trace::set_thread_name("ircom server shard");
+      shard.io_ctx.run();
+    });
+  }
   io_ctx_thread_ = std::thread(&server::io_ctx_thread_f, this);
 }
 
 server::~server() {
   boost::asio::post(io_ctx_, [&]() {
-    sock_.close();
+    links_.close_all();
     acceptor_.close();
     shutdown_issued_ = true;
   });
   io_ctx_thread_.join();
+
+  // No connection is handed over anymore.
+  for (const std::unique_ptr<internal::server_shard>& shard : shards_) {
+    boost::asio::post(shard->io_ctx, [&shard = *shard]() {
+      shard.links.close_all();
+      shard.work.reset();
+    });
+  }
+  for (const std::unique_ptr<internal::server_shard>& shard : shards_)
+    shard->thread.join();
+}
+
+send_status server::send_update(const packet::payload& pl, lane ln) {
+  if (shards_.empty()) return links_.send_update(pl, ln);
+  return send_to_shards(pl, ln, nullptr);
+}
+
+send_receipt server::send_update_tracked(const packet::payload& pl, lane ln) {
+  if (shards_.empty()) return links_.send_update_tracked(pl, ln);
+
+  std::shared_ptr<internal::delivery> dl =
+      std::make_shared<internal::delivery>();
+  std::future<bool> written = dl->get_future();
+  send_status status = send_to_shards(pl, ln, std::move(dl));
+  return {.status = status, .written = std::move(written)};
+}
+
+send_status server::send_to_shards(const packet::payload& pl, lane ln,
+                                   std::shared_ptr<internal::delivery> dl) {
+  std::uint32_t number = state_->next_update_seq++;
+  send_status status = links_.send_numbered_update(number, pl, ln, dl);
+  for (const std::unique_ptr<internal::server_shard>& shard : shards_) {
+    // The most favourable status in declaration order, as a shard without
+    // connections drops every update.
+    status = std::min(status,
+                      shard->links.send_numbered_update(number, pl, ln, dl));
+  }
+  return status;
 }
 
-void server::send_update(const packet::payload& pl) {
-  udkeeper_.send_update(pl);
+packet::payload server::latest_update() { return links_.latest_update(); }
+
+send_status server::send_message(boost::asio::const_buffer data,
+                                 std::shared_ptr<const void> owner) {
+  if (shards_.empty()) return links_.send_message(data, std::move(owner));
+
+  std::shared_ptr<const void> slot =
+      internal::admit_message(state_, data, std::move(owner));
+  if (!slot) return send_status::dropped;
+  std::uint32_t id = state_->next_message_id++;
+  send_status status = links_.send_numbered_message(id, data, slot);
+  for (const std::unique_ptr<internal::server_shard>& shard : shards_) {
+    status =
+        std::min(status, shard->links.send_numbered_message(id, data, slot));
+  }
+  return status;
 }
 
-packet::payload server::latest_update() { return udkeeper_.latest_update(); }
+std::optional<message::buffer> server::next_message() {
+  return links_.next_message();
+}
+
+latency::breakdown server::latency_breakdown() {
+  return links_.latency_breakdown();
+}
 
 boost::asio::awaitable<void> server::handler() {
   // Indeed, connections can reach the backlogs after `acceptor_` is opened.
@@ -110,8 +1205,17 @@ boost::asio::awaitable<void> server::handler() {
     // Check against shutdown before the first iteration (e.g. when the
     // destrctor is called before the start of the IO context thread).
     while (!shutdown_issued_) {
+      // Round robin over the shards, the first one being `links_`.
+      std::size_t shard_index = next_shard_;
+      next_shard_ = (next_shard_ + 1) % (shards_.size() + 1);
+      boost::asio::io_context& io_ctx =
+          shard_index == 0 ? io_ctx_ : shards_[shard_index - 1]->io_ctx;
+      link_group& links =
+          shard_index == 0 ? links_ : shards_[shard_index - 1]->links;
+
+      boost::asio::ip::tcp::socket sock(io_ctx);
       try {
-        co_await acceptor_.async_accept(sock_, boost::asio::use_awaitable);
+        co_await acceptor_.async_accept(sock, boost::asio::use_awaitable);
       } catch (const boost::system::system_error& err) {
         if (err.code() == boost::asio::error::operation_aborted) {
           spdlog::info("Acceptor shut down");
@@ -120,42 +1224,53 @@ boost::asio::awaitable<void> server::handler() {
         throw;
       }
 
-      boost::asio::ip::tcp::endpoint remote_endpoint = sock_.remote_endpoint();
+      trace::instant("connect", "accepted", "shard", shard_index);
+      boost::asio::ip::tcp::endpoint remote_endpoint = sock.remote_endpoint();
       spdlog::info("New connection from {}:{}",
                    remote_endpoint.address().to_string(),
                    remote_endpoint.port());
 
-      try {
-        co_await udkeeper_.handle_updates();
-      } catch (const boost::system::system_error& err) {
-        if (err.code() == boost::asio::error::operation_aborted ||
-            err.code() == boost::asio::error::eof && shutdown_issued_) {
-          spdlog::info("Ongoing communication shut down");
-          break;
-        }
-
-        spdlog::error(
-            "An error occurred for the connection, discarding connection: {}",
-            err.what());
-        sock_.close();
-        continue;
-      }
+      boost::asio::co_spawn(io_ctx, session(links, std::move(sock)),
+                            boost::asio::detached);
     }
   } catch (const std::exception& err) {
     spdlog::critical("An error is uncaught in the server handler: {}",
                      err.what());
-    io_ctx_.stop();
+    stop_all();
+    co_return;
+  }
+}
+
+boost::asio::awaitable<void> server::session(
+    link_group& links, boost::asio::ip::tcp::socket sock) {
+  try {
+    co_await links.serve(links.make_link(std::move(sock)));
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in a server session: {}",
+                     err.what());
+    stop_all();
     co_return;
   }
 }
 
+void server::stop_all() {
+  io_ctx_.stop();
+  for (const std::unique_ptr<internal::server_shard>& shard : shards_)
+    shard->io_ctx.stop();
+}
+
 void server::io_ctx_thread_f() {
+  trace::set_thread_name("ircom server");
   boost::asio::co_spawn(io_ctx_, handler(), boost::asio::detached);
   io_ctx_.run();
 }
 
-client::client(const char* target_service_name)
-    : browser_(target_service_name) {
+client::client(const char* target_service_name, const client_options& opts)
+    : opts_(opts),
+      browser_(target_service_name, discovery::DISCOVERY_SERVICE_TYPE,
+               opts.port) {
+  if (opts.hot_standby && opts.heartbeat_interval.count() <= 0)
+    throw std::invalid_argument("Heartbeat interval must be positive");
   io_ctx_thread_ = std::thread(&client::io_ctx_thread_f, this);
 }
 
@@ -163,57 +1278,162 @@ client::~client() {
   browser_.close();
   boost::asio::post(io_ctx_, [&]() {
     resolver_.cancel();
-    sock_.close();
+    discovery_timer_.cancel();
+    reprobe_timer_.cancel();
+    links_.close_all();
     shutdown_issued_ = true;
   });
   io_ctx_thread_.join();
 }
 
-void client::send_update(const packet::payload& pl) {
-  udkeeper_.send_update(pl);
+send_status client::send_update(const packet::payload& pl, lane ln) {
+  return links_.send_update(pl, ln);
+}
+
+send_receipt client::send_update_tracked(const packet::payload& pl, lane ln) {
+  return links_.send_update_tracked(pl, ln);
+}
+
+packet::payload client::latest_update() { return links_.latest_update(); }
+
+send_status client::send_message(boost::asio::const_buffer data,
+                                 std::shared_ptr<const void> owner) {
+  return links_.send_message(data, std::move(owner));
 }
 
-packet::payload client::latest_update() { return udkeeper_.latest_update(); }
+std::optional<message::buffer> client::next_message() {
+  return links_.next_message();
+}
+
+latency::breakdown client::latency_breakdown() {
+  return links_.latency_breakdown();
+}
 
 boost::asio::awaitable<void> client::connect() {
   try {
+    bool discovery_settled = false;
     // Check against shutdown before the first iteration (e.g. when the
     // destrctor is called before the start of the IO context thread).
     while (!shutdown_issued_) {
-      spdlog::info("Discovering services");
       discovery::service_info info;
+      std::shared_ptr<update_keeper> keeper;
+      if (migration_) {
+        info = std::move(migration_->info);
+        keeper = std::move(migration_->keeper);
+        migration_.reset();
+        spdlog::info("Migrated to service @ {} (interface: {})", info.addr,
+                     info.interface);
+      } else {
+        spdlog::info("Discovering services");
+        std::vector<discovery::service_info> candidates;
+        try {
+          // TODO: Use an async version of `get_latest_service`.
+          info = browser_.get_latest_service();
+          if (opts_.probe_latency) {
+            if (!discovery_settled) {
+              // Otherwise only the first discovered instance is known yet, and
+              // connected to without probing.
+              trace::scope span("connect", "discovery_settle");
+              discovery_timer_.expires_after(PROBE_SETTLE_TIME);
+              boost::system::error_code ec;
+              co_await discovery_timer_.async_wait(
+                  boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+              discovery_settled = true;
+            }
+            candidates = browser_.get_services();
+          }
+        } catch (const discovery::closed_exception&) {
+          spdlog::info("Service discovery stopped");
+          break;
+        }
+        if (shutdown_issued_) break;
+
+        if (candidates.size() > 1) {
+          std::vector<internal::probe_result> results =
+              co_await probe_services(std::move(candidates));
+          if (shutdown_issued_) break;
+          if (!results.empty()) {
+            info = std::move(results.front().info);
+            keeper = std::move(results.front().keeper);
+            results.erase(results.begin());
+          }
+          // Only the fastest connection is kept.
+          for (const internal::probe_result& result : results)
+            links_.remove(result.keeper);
+        }
+        spdlog::info("Selected service @ {}", info.addr);
+
+        if (!keeper) {
+          if (!co_await connect_link(info, keeper)) break;
+        }
+        if (!keeper) {
+          // Retry cooldown.
+          trace::scope span("connect", "retry_cooldown");
+          boost::asio::steady_timer timer(io_ctx_,
+                                          boost::asio::chrono::seconds(1));
+          co_await timer.async_wait(boost::asio::use_awaitable);
+
+          continue;
+        }
+      }
+
+      primary_service_ = info;
+      primary_ = keeper;
+      bool is_open = co_await links_.serve(std::move(keeper));
+      primary_service_.reset();
+      primary_.reset();
+      if (!is_open) break;
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in the client connection loop: {}",
+                     err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+}
+
+boost::asio::awaitable<void> client::maintain_links() {
+  try {
+    while (!shutdown_issued_) {
+      std::vector<discovery::service_info> services;
       try {
-        // TODO: Use an async version of `get_latest_service`.
-        info = browser_.get_latest_service();
+        services = browser_.get_services();
       } catch (const discovery::closed_exception&) {
         spdlog::info("Service discovery stopped");
         break;
       }
-      spdlog::info("Selected service @ {}", info.addr);
 
-      bool should_retry = false;
-      try {
-        boost::asio::ip::tcp::resolver::results_type endpoints =
-            co_await resolver_.async_resolve(info.addr, SERVICE_PORT_STR,
-                                             boost::asio::use_awaitable);
-
-        spdlog::info("Connecting to service");
-        co_await boost::asio::async_connect(sock_, endpoints,
-                                            boost::asio::use_awaitable);
-        spdlog::info("Connected to service");
-      } catch (const boost::system::system_error& err) {
-        if (err.code() == boost::asio::error::operation_aborted) {
-          spdlog::info("Connection attempt cancelled");
-          break;
-        }
+      for (const discovery::service_info& info : services) {
+        if (!linked_services_.emplace(info.interface, info.addr).second)
+          continue;
 
-        spdlog::warn("Failed to connect to remote, will retry: {}", err.what());
-        should_retry = true;
+        spdlog::info("Adding redundant link to service @ {} (interface: {})",
+                     info.addr, info.interface);
+        boost::asio::co_spawn(io_ctx_, run_link(info), boost::asio::detached);
       }
-      if (should_retry) {
-        sock_.close();
 
+      discovery_timer_.expires_after(DISCOVERY_POLL_INTERVAL);
+      boost::system::error_code ec;
+      co_await discovery_timer_.async_wait(
+          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in the client link maintainer: {}",
+                     err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+}
+
+boost::asio::awaitable<void> client::run_link(discovery::service_info info) {
+  try {
+    // Drop the link once the service disappears from this interface.
+    while (!shutdown_issued_ && is_service_available(info)) {
+      std::shared_ptr<update_keeper> keeper;
+      if (!co_await connect_link(info, keeper)) break;
+      if (!keeper) {
         // Retry cooldown.
+        trace::scope span("connect", "retry_cooldown");
         boost::asio::steady_timer timer(io_ctx_,
                                         boost::asio::chrono::seconds(1));
         co_await timer.async_wait(boost::asio::use_awaitable);
@@ -221,32 +1441,342 @@ boost::asio::awaitable<void> client::connect() {
         continue;
       }
 
+      if (!co_await links_.serve(std::move(keeper))) break;
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in a client link: {}", err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+
+  spdlog::info("Dropped redundant link to service @ {} (interface: {})",
+               info.addr, info.interface);
+  linked_services_.erase({info.interface, info.addr});
+}
+
+boost::asio::awaitable<bool> client::connect_link(
+    const discovery::service_info& info,
+    std::shared_ptr<update_keeper>& keeper) {
+  trace::scope span("connect", "connect_link");
+  std::shared_ptr<update_keeper> new_keeper = links_.make_link();
+  try {
+    boost::asio::ip::tcp::resolver::results_type endpoints =
+        co_await resolver_.async_resolve(info.addr, std::to_string(opts_.port),
+                                         boost::asio::use_awaitable);
+
+    spdlog::info("Connecting to service @ {}", info.addr);
+    co_await boost::asio::async_connect(new_keeper->socket(), endpoints,
+                                        boost::asio::use_awaitable);
+    spdlog::info("Connected to service @ {}", info.addr);
+  } catch (const boost::system::system_error& err) {
+    links_.remove(new_keeper);
+    if (err.code() == boost::asio::error::operation_aborted) {
+      spdlog::info("Connection attempt cancelled");
+      co_return false;
+    }
+
+    spdlog::warn("Failed to connect to remote, will retry: {}", err.what());
+    co_return true;
+  }
+
+  keeper = std::move(new_keeper);
+  co_return true;
+}
+
+boost::asio::awaitable<void> client::maintain_hot_standby() {
+  const std::chrono::steady_clock::duration tick =
+      opts_.heartbeat_interval / PINGS_PER_HEARTBEAT_INTERVAL;
+  try {
+    while (!shutdown_issued_) {
+      std::vector<discovery::service_info> services;
       try {
-        co_await udkeeper_.handle_updates();
-      } catch (const boost::system::system_error& err) {
-        if (err.code() == boost::asio::error::operation_aborted ||
-            err.code() == boost::asio::error::eof && shutdown_issued_) {
-          spdlog::info("Ongoing communication shut down");
-          break;
+        services = browser_.get_services();
+      } catch (const discovery::closed_exception&) {
+        spdlog::info("Service discovery stopped");
+        break;
+      }
+
+      links_.ping_links(opts_.heartbeat_interval * 3 / 4);
+
+      if (!primary_service_ && !promote_standby()) {
+        // The latest instance, as in single link mode.
+        auto it = std::find_if(
+            services.rbegin(), services.rend(),
+            [&](const discovery::service_info& info) {
+              return !standby_service_ ||
+                     !is_same_instance(info, *standby_service_);
+            });
+        if (it != services.rend()) {
+          spdlog::info("Selected service @ {}", it->addr);
+          primary_service_ = *it;
+          boost::asio::co_spawn(io_ctx_, run_hot_standby_link(*it, false),
+                                boost::asio::detached);
         }
+      }
 
-        spdlog::error(
-            "An error occurred for the connection, discarding connection: {}",
-            err.what());
-        sock_.close();
-        continue;
+      if (primary_service_ && !standby_service_) {
+        // Prefer another host over another interface to the same host.
+        const discovery::service_info* candidate = nullptr;
+        for (const discovery::service_info& info : services) {
+          if (is_same_instance(info, *primary_service_)) continue;
+          if (!candidate || info.addr != primary_service_->addr)
+            candidate = &info;
+        }
+        if (candidate) {
+          spdlog::info("Selected standby service @ {} (interface: {})",
+                       candidate->addr, candidate->interface);
+          standby_service_ = *candidate;
+          boost::asio::co_spawn(io_ctx_,
+                                run_hot_standby_link(*candidate, true),
+                                boost::asio::detached);
+        }
       }
+
+      discovery_timer_.expires_after(tick);
+      boost::system::error_code ec;
+      co_await discovery_timer_.async_wait(
+          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
     }
   } catch (const std::exception& err) {
-    spdlog::critical("An error is uncaught in the client connection loop: {}",
+    spdlog::critical("An error is uncaught in the client link maintainer: {}",
+                     err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+}
+
+boost::asio::awaitable<void> client::run_hot_standby_link(
+    discovery::service_info info, bool standby) {
+  try {
+    std::shared_ptr<update_keeper> keeper;
+    if (!co_await connect_link(info, keeper)) co_return;
+    if (!keeper) {
+      // Retry cooldown, the slot is refilled afterwards.
+      trace::scope span("connect", "retry_cooldown");
+      boost::asio::steady_timer timer(io_ctx_,
+                                      boost::asio::chrono::seconds(1));
+      co_await timer.async_wait(boost::asio::use_awaitable);
+      (standby ? standby_service_ : primary_service_).reset();
+      co_return;
+    }
+
+    links_.set_standby(keeper, standby);
+    (standby ? standby_ : primary_) = keeper;
+    if (!co_await links_.serve(keeper)) co_return;
+
+    // The standby may have been promoted meanwhile.
+    if (keeper == primary_) {
+      primary_.reset();
+      primary_service_.reset();
+      if (promote_standby()) {
+        spdlog::warn("Primary link @ {} lost, failed over to standby @ {}",
+                     info.addr, primary_service_->addr);
+        trace::instant("connect", "failover");
+      }
+    } else if (keeper == standby_) {
+      standby_.reset();
+      // Retry cooldown, e.g. against a peer accepting but never answering.
+      trace::scope span("connect", "retry_cooldown");
+      boost::asio::steady_timer timer(io_ctx_,
+                                      boost::asio::chrono::seconds(1));
+      co_await timer.async_wait(boost::asio::use_awaitable);
+      standby_service_.reset();
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in a client link: {}", err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+}
+
+bool client::promote_standby() {
+  if (!standby_) return false;
+
+  links_.set_standby(standby_, false);
+  primary_service_ = std::move(standby_service_);
+  primary_ = std::move(standby_);
+  standby_service_.reset();
+  standby_.reset();
+  return true;
+}
+
+boost::asio::awaitable<void> client::reprobe() {
+  try {
+    while (!shutdown_issued_) {
+      reprobe_timer_.expires_after(opts_.reprobe_interval);
+      boost::system::error_code ec;
+      co_await reprobe_timer_.async_wait(
+          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+      if (shutdown_issued_) break;
+      if (!primary_ || migration_) continue;
+
+      std::vector<discovery::service_info> candidates;
+      try {
+        candidates = browser_.get_services();
+      } catch (const discovery::closed_exception&) {
+        break;
+      }
+      if (candidates.size() < 2) continue;
+
+      // The current instance is probed as well, for its connect time to be
+      // comparable.
+      std::vector<internal::probe_result> results =
+          co_await probe_services(std::move(candidates));
+      auto current = std::find_if(
+          results.begin(), results.end(),
+          [&](const internal::probe_result& result) {
+            return primary_service_ &&
+                   is_same_instance(result.info, *primary_service_);
+          });
+      if (primary_ && current != results.end() && current != results.begin() &&
+          results.front().connect_time <
+              current->connect_time * MIGRATION_CONNECT_TIME_RATIO) {
+        spdlog::info(
+            "Service @ {} (interface: {}) connects in {} us, {} us for the "
+            "current one, migrating",
+            results.front().info.addr, results.front().info.interface,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                results.front().connect_time)
+                .count(),
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                current->connect_time)
+                .count());
+        trace::instant("connect", "migrate");
+        migration_ = std::move(results.front());
+        results.erase(results.begin());
+        // Ends the current link, `connect` then serves the migration target.
+        primary_->socket().shutdown(
+            boost::asio::ip::tcp::socket::shutdown_both, ec);
+      }
+
+      for (const internal::probe_result& result : results)
+        links_.remove(result.keeper);
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical("An error is uncaught in the client latency prober: {}",
                      err.what());
     io_ctx_.stop();
     co_return;
   }
 }
 
+boost::asio::awaitable<std::vector<internal::probe_result>>
+client::probe_services(std::vector<discovery::service_info> candidates) {
+  trace::scope span("connect", "probe_services", "candidates",
+                    candidates.size());
+  // Resolved beforehand, such that every attempt starts at once.
+  std::vector<internal::probe_result> probes;
+  std::vector<boost::asio::ip::tcp::resolver::results_type> endpoints;
+  for (discovery::service_info& info : candidates) {
+    try {
+      endpoints.push_back(co_await resolver_.async_resolve(
+          info.addr, std::to_string(opts_.port), boost::asio::use_awaitable));
+    } catch (const boost::system::system_error& err) {
+      // Attempts are still started, in order to clean up in one place.
+      if (err.code() == boost::asio::error::operation_aborted) break;
+      spdlog::debug("Failed to resolve service @ {}: {}", info.addr,
+                    err.what());
+      continue;
+    }
+    probes.push_back({.info = std::move(info), .keeper = links_.make_link()});
+  }
+
+  // Woken whenever an attempt finished.
+  boost::asio::steady_timer done(io_ctx_);
+  std::size_t pending = probes.size();
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + PROBE_TIMEOUT;
+  for (std::size_t i = 0; i < probes.size(); ++i) {
+    boost::asio::co_spawn(
+        io_ctx_,
+        [&, i]() -> boost::asio::awaitable<void> {
+          internal::probe_result& probe = probes[i];
+          std::chrono::steady_clock::time_point start =
+              std::chrono::steady_clock::now();
+          try {
+            co_await boost::asio::async_connect(probe.keeper->socket(),
+                                                endpoints[i],
+                                                boost::asio::use_awaitable);
+            std::chrono::steady_clock::time_point now =
+                std::chrono::steady_clock::now();
+            probe.connect_time = now - start;
+            // Those still running once twice as long passed would not be
+            // selected anyway.
+            deadline = std::min(deadline, now + probe.connect_time);
+          } catch (const boost::system::system_error& err) {
+            spdlog::debug("Failed to probe service @ {}: {}", probe.info.addr,
+                          err.what());
+          }
+          --pending;
+          done.cancel();
+        },
+        boost::asio::detached);
+  }
+
+  boost::system::error_code ec;
+  while (pending > 0 && std::chrono::steady_clock::now() < deadline) {
+    done.expires_at(deadline);
+    co_await done.async_wait(
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+  }
+  // Aborts the attempts still running.
+  for (internal::probe_result& probe : probes) {
+    if (probe.connect_time == std::chrono::steady_clock::duration::zero())
+      probe.keeper->socket().close();
+  }
+  done.expires_at(std::chrono::steady_clock::time_point::max());
+  while (pending > 0)
+    co_await done.async_wait(
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+  std::vector<internal::probe_result> results;
+  for (internal::probe_result& probe : probes) {
+    if (probe.keeper->socket().is_open()) {
+      spdlog::debug("Service @ {} (interface: {}) connects in {} us",
+                    probe.info.addr, probe.info.interface,
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        probe.connect_time)
+                        .count());
+      results.push_back(std::move(probe));
+    } else {
+      links_.remove(probe.keeper);
+    }
+  }
+  std::sort(results.begin(), results.end(),
+            [](const internal::probe_result& a,
+               const internal::probe_result& b) {
+              return a.connect_time < b.connect_time;
+            });
+  co_return results;
+}
+
+bool client::is_service_available(const discovery::service_info& info) {
+  std::vector<discovery::service_info> services;
+  try {
+    services = browser_.get_services();
+  } catch (const discovery::closed_exception&) {
+    return false;
+  }
+
+  return std::any_of(services.begin(), services.end(),
+                     [&](const discovery::service_info& service) {
+                       return service.interface == info.interface &&
+                              service.addr == info.addr;
+                     });
+}
+
 void client::io_ctx_thread_f() {
-  boost::asio::co_spawn(io_ctx_, connect(), boost::asio::detached);
+  trace::set_thread_name("ircom client");
+  if (opts_.redundant) {
+    boost::asio::co_spawn(io_ctx_, maintain_links(), boost::asio::detached);
+  } else if (opts_.hot_standby) {
+    boost::asio::co_spawn(io_ctx_, maintain_hot_standby(),
+                          boost::asio::detached);
+  } else {
+    boost::asio::co_spawn(io_ctx_, connect(), boost::asio::detached);
+    if (opts_.probe_latency && opts_.reprobe_interval.count() > 0)
+      boost::asio::co_spawn(io_ctx_, reprobe(), boost::asio::detached);
+  }
   io_ctx_.run();
 }
 
@@ -0,0 +1,47 @@
+#include "ircom/latency.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace ircom::latency {
+
+recorder::recorder(timestamping mode) : mode_(mode) {
+  for (boost::circular_buffer<std::int64_t>& samples : samples_)
+    samples.set_capacity(WINDOW);
+}
+
+void recorder::record(stage st, std::chrono::nanoseconds duration) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  samples_[static_cast<std::size_t>(st)].push_back(duration.count());
+}
+
+breakdown recorder::snapshot() {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return {
+      .queueing = stats(stage::queueing),
+      .kernel_send = stats(stage::kernel_send),
+      .network_round_trip = stats(stage::network_round_trip),
+      .receive = stats(stage::receive),
+  };
+}
+
+stage_stats recorder::stats(stage st) const {
+  const boost::circular_buffer<std::int64_t>& samples =
+      samples_[static_cast<std::size_t>(st)];
+  if (samples.empty()) return {};
+
+  std::vector<std::int64_t> sorted(samples.begin(), samples.end());
+  std::sort(sorted.begin(), sorted.end());
+  std::int64_t sum = 0;
+  for (std::int64_t sample : sorted) sum += sample;
+
+  return {
+      .count = sorted.size(),
+      .mean = std::chrono::nanoseconds(sum / std::int64_t(sorted.size())),
+      .p50 = std::chrono::nanoseconds(sorted[(sorted.size() - 1) / 2]),
+      .p99 = std::chrono::nanoseconds(sorted[(sorted.size() - 1) * 99 / 100]),
+      .max = std::chrono::nanoseconds(sorted.back()),
+  };
+}
+
+}  // namespace ircom::latency
@@ -0,0 +1,74 @@
+#include "ircom/message.h"
+
+#include <utility>
+
+namespace ircom::message {
+
+buffer::buffer(std::shared_ptr<internal::pool_state> pool,
+               std::vector<std::uint8_t> storage, std::size_t size)
+    : pool_(std::move(pool)), storage_(std::move(storage)), size_(size) {}
+
+buffer::buffer(buffer&& other) noexcept
+    : pool_(std::move(other.pool_)),
+      storage_(std::move(other.storage_)),
+      size_(std::exchange(other.size_, 0)) {}
+
+buffer& buffer::operator=(buffer&& other) noexcept {
+  if (this != &other) {
+    release();
+    pool_ = std::move(other.pool_);
+    storage_ = std::move(other.storage_);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+buffer::~buffer() { release(); }
+
+void buffer::release() {
+  if (!pool_) return;
+
+  {
+    std::lock_guard<std::mutex> lock(pool_->mtx);
+    if (pool_->free_storages.size() < pool_->max_cached)
+      pool_->free_storages.push_back(std::move(storage_));
+  }
+  pool_.reset();
+  storage_ = {};
+  size_ = 0;
+}
+
+buffer_pool::buffer_pool(std::size_t max_cached)
+    : state_(std::make_shared<internal::pool_state>()) {
+  state_->max_cached = max_cached;
+}
+
+buffer buffer_pool::acquire(std::size_t size) {
+  std::vector<std::uint8_t> storage;
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    std::vector<std::vector<std::uint8_t>>& free_storages =
+        state_->free_storages;
+
+    // Prefer the smallest cached storage that fits to keep large storages
+    // available for large messages.
+    auto best = free_storages.end();
+    for (auto it = free_storages.begin(); it != free_storages.end(); ++it) {
+      if (it->size() < size) continue;
+      if (best == free_storages.end() || it->size() < best->size()) best = it;
+    }
+    if (best == free_storages.end() && !free_storages.empty()) {
+      best = free_storages.begin();
+    }
+    if (best != free_storages.end()) {
+      storage = std::move(*best);
+      free_storages.erase(best);
+    }
+  }
+
+  // Only grow. Storage beyond `size` is left untouched.
+  if (storage.size() < size) storage.resize(size);
+  return buffer(state_, std::move(storage), size);
+}
+
+}  // namespace ircom::message
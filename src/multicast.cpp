@@ -0,0 +1,256 @@
+#include "ircom/multicast.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "boost/system/system_error.hpp"
+#include "ircom/trace.h"
+#include "spdlog/spdlog.h"
+
+namespace ircom {
+
+namespace {
+
+// Epoch announced by a publisher, none if it predates announcing it.
+std::optional<std::uint32_t> announced_epoch(
+    const discovery::service_info& info) {
+  for (const std::string& entry : info.txt) {
+    if (entry.starts_with(MULTICAST_TXT_EPOCH_KEY)) {
+      return static_cast<std::uint32_t>(std::strtoul(
+          entry.c_str() + MULTICAST_TXT_EPOCH_KEY.size(), nullptr, 10));
+    }
+  }
+  return std::nullopt;
+}
+
+}  // namespace
+
+multicast_publisher::multicast_publisher(const char* service_name,
+                                         const multicast_options& opts)
+    : opts_(opts),
+      epoch_(std::random_device()()),
+      publisher_(service_name, discovery::MULTICAST_SERVICE_TYPE, opts.port,
+                 {MULTICAST_TXT_GROUP_KEY + opts.group,
+                  MULTICAST_TXT_EPOCH_KEY + std::to_string(epoch_)}),
+      group_endpoint_(boost::asio::ip::make_address(opts.group), opts.port) {
+  sock_.open(group_endpoint_.protocol());
+  sock_.set_option(boost::asio::ip::multicast::hops(opts_.ttl));
+  // Such that subscribers on the same host receive the updates as well.
+  sock_.set_option(boost::asio::ip::multicast::enable_loopback(true));
+
+  io_ctx_thread_ = std::thread(&multicast_publisher::io_ctx_thread_f, this);
+}
+
+multicast_publisher::~multicast_publisher() {
+  boost::asio::post(io_ctx_, [&]() { sock_.close(); });
+  work_guard_.reset();
+  io_ctx_thread_.join();
+}
+
+send_status multicast_publisher::send_update(const packet::payload& pl) {
+  bool is_conflated;
+  {
+    std::lock_guard<std::mutex> lock(pending_update_mtx_);
+    is_conflated = pending_update_.has_value();
+    pending_update_ = pl;
+  }
+
+  // A flush is already scheduled if an update is pending.
+  if (is_conflated) return send_status::conflated;
+  boost::asio::post(io_ctx_, [this]() { flush(); });
+  return send_status::queued;
+}
+
+void multicast_publisher::flush() {
+  packet::payload pl;
+  {
+    std::lock_guard<std::mutex> lock(pending_update_mtx_);
+    if (!pending_update_) return;
+    pl = *pending_update_;
+    pending_update_.reset();
+  }
+  if (!sock_.is_open()) return;
+
+  packet::sequence seq = {.epoch = epoch_, .number = next_update_seq_++};
+  std::vector<std::uint8_t> body_bytes;
+  body_bytes.push_back(packet::FRAME_UPDATE);
+  seq.serialize(body_bytes);
+  pl.serialize(body_bytes);
+
+  std::array<boost::asio::const_buffer, 3> bufs = {
+      packet::HEADER_BUF,
+      boost::asio::buffer(body_bytes),
+      packet::FOOTER_BUF,
+  };
+
+  // Datagram sockets never block for long, no need to go asynchronous.
+  boost::system::error_code ec;
+  sock_.send_to(bufs, group_endpoint_, 0, ec);
+  trace::instant("send", "multicast_update", "seq", seq.number);
+  if (ec) spdlog::warn("Failed to send multicast update: {}", ec.message());
+}
+
+void multicast_publisher::io_ctx_thread_f() {
+  trace::set_thread_name("ircom multicast publisher");
+  publisher_.publish();
+  spdlog::info("Multicast group {}:{} published", opts_.group, opts_.port);
+
+  io_ctx_.run();
+}
+
+multicast_subscriber::multicast_subscriber(const char* target_service_name,
+                                           const multicast_options& opts)
+    : opts_(opts),
+      browser_(target_service_name, discovery::MULTICAST_SERVICE_TYPE,
+               opts.port) {
+  io_ctx_thread_ = std::thread(&multicast_subscriber::io_ctx_thread_f, this);
+}
+
+multicast_subscriber::~multicast_subscriber() {
+  browser_.close();
+  boost::asio::post(io_ctx_, [&]() {
+    sock_.close();
+    shutdown_issued_ = true;
+  });
+  io_ctx_thread_.join();
+}
+
+packet::payload multicast_subscriber::latest_update() {
+  return inbox_.latest_update();
+}
+
+boost::asio::awaitable<void> multicast_subscriber::receive() {
+  try {
+    // Check against shutdown before the first iteration (e.g. when the
+    // destrctor is called before the start of the IO context thread).
+    while (!shutdown_issued_) {
+      spdlog::info("Discovering multicast groups");
+      discovery::service_info info;
+      try {
+        // TODO: Use an async version of `get_latest_service`.
+        info = browser_.get_latest_service();
+      } catch (const discovery::closed_exception&) {
+        spdlog::info("Service discovery stopped");
+        break;
+      }
+
+      std::string group = opts_.group;
+      for (const std::string& entry : info.txt) {
+        if (entry.starts_with(MULTICAST_TXT_GROUP_KEY))
+          group = entry.substr(MULTICAST_TXT_GROUP_KEY.size());
+      }
+      spdlog::info("Selected multicast group {}:{} announced by {}", group,
+                   opts_.port, info.addr);
+      std::optional<std::uint32_t> epoch = announced_epoch(info);
+      std::chrono::steady_clock::time_point next_lookup_at;
+
+      try {
+        boost::asio::ip::address group_addr =
+            boost::asio::ip::make_address(group);
+        boost::asio::ip::udp::endpoint listen_endpoint(
+            group_addr.is_v4() ? boost::asio::ip::udp::v4()
+                               : boost::asio::ip::udp::v6(),
+            opts_.port);
+        sock_.open(listen_endpoint.protocol());
+        // Several subscribers may run on the same host.
+        sock_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+        sock_.bind(listen_endpoint);
+        sock_.set_option(boost::asio::ip::multicast::join_group(group_addr));
+
+        while (true) {
+          // One extra byte to detect oversized datagrams.
+          std::array<std::uint8_t, packet::UPDATE_FRAME_SIZE + 1> buf;
+          boost::asio::ip::udp::endpoint sender;
+          std::size_t size = co_await sock_.async_receive_from(
+              boost::asio::buffer(buf), sender, boost::asio::use_awaitable);
+
+          const std::uint8_t* body =
+              buf.data() + packet::HEADER_SIZE + packet::FRAME_TYPE_SIZE;
+          if (size != packet::UPDATE_FRAME_SIZE ||
+              std::memcmp(buf.data(), packet::HEADER, packet::HEADER_SIZE) !=
+                  0 ||
+              buf[packet::HEADER_SIZE] != packet::FRAME_UPDATE ||
+              std::memcmp(body + packet::SEQUENCE_SIZE + packet::PAYLOAD_SIZE,
+                          packet::FOOTER, packet::FOOTER_SIZE) != 0) {
+            spdlog::debug("Ignoring malformed datagram from {}:{}",
+                          sender.address().to_string(), sender.port());
+            continue;
+          }
+
+          packet::sequence seq;
+          seq.deserialize(body);
+          packet::payload pl;
+          pl.deserialize(body + packet::SEQUENCE_SIZE);
+
+          // Anyone may send to the group. Discovery is looked up at most once
+          // per interval, as the others may send at a high rate.
+          if (epoch && seq.epoch != *epoch) {
+            std::chrono::steady_clock::time_point now =
+                std::chrono::steady_clock::now();
+            bool announced = false;
+            if (now >= next_lookup_at) {
+              next_lookup_at = now + DISCOVERY_POLL_INTERVAL;
+              announced = is_announced(seq.epoch);
+            }
+            if (!announced) {
+              spdlog::debug("Ignoring datagram from {}:{}, not the publisher",
+                            sender.address().to_string(), sender.port());
+              continue;
+            }
+            spdlog::info("Following newly announced publisher epoch {}",
+                         seq.epoch);
+            epoch = seq.epoch;
+          }
+
+          // Datagrams may be reordered, stale ones are dropped here.
+          trace::instant("receive", "multicast_update", "seq", seq.number);
+          inbox_.accept_update(seq, pl);
+        }
+      } catch (const boost::system::system_error& err) {
+        if (err.code() == boost::asio::error::operation_aborted ||
+            shutdown_issued_) {
+          spdlog::info("Multicast subscription shut down");
+          break;
+        }
+
+        spdlog::error("An error occurred for the subscription, will retry: {}",
+                      err.what());
+        sock_.close();
+      }
+
+      // Retry cooldown.
+      boost::asio::steady_timer timer(io_ctx_, boost::asio::chrono::seconds(1));
+      co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+  } catch (const std::exception& err) {
+    spdlog::critical(
+        "An error is uncaught in the multicast subscription loop: {}",
+        err.what());
+    io_ctx_.stop();
+    co_return;
+  }
+}
+
+bool multicast_subscriber::is_announced(std::uint32_t epoch) {
+  std::vector<discovery::service_info> services = browser_.get_services();
+  return std::any_of(services.begin(), services.end(),
+                     [epoch](const discovery::service_info& info) {
+                       return announced_epoch(info) == epoch;
+                     });
+}
+
+void multicast_subscriber::io_ctx_thread_f() {
+  trace::set_thread_name("ircom multicast subscriber");
+  boost::asio::co_spawn(io_ctx_, receive(), boost::asio::detached);
+  io_ctx_.run();
+}
+
+}  // namespace ircom
@@ -6,6 +6,29 @@
 
 namespace ircom::packet {
 
+void sequence::serialize(std::vector<std::uint8_t>& out) const {
+  boost::endian::big_uint32_buf_t u32_buf;
+
+  u32_buf = epoch;
+  out.insert(out.end(), u32_buf.data(), u32_buf.data() + sizeof(u32_buf));
+
+  u32_buf = number;
+  out.insert(out.end(), u32_buf.data(), u32_buf.data() + sizeof(u32_buf));
+}
+
+void sequence::deserialize(const std::uint8_t* in) {
+  boost::endian::big_uint32_buf_t u32_buf;
+  int idx = 0;
+
+  std::memcpy(u32_buf.data(), in + idx, sizeof(u32_buf));
+  epoch = u32_buf.value();
+  idx += sizeof(u32_buf);
+
+  std::memcpy(u32_buf.data(), in + idx, sizeof(u32_buf));
+  number = u32_buf.value();
+  idx += sizeof(u32_buf);
+}
+
 void payload::serialize(std::vector<std::uint8_t>& out) const {
   boost::endian::big_float64_buf_t f64_buf;
 
@@ -36,4 +59,39 @@ void payload::deserialize(const std::uint8_t* in) {
   idx += sizeof(f64_buf);
 }
 
+void chunk_header::serialize(std::vector<std::uint8_t>& out) const {
+  boost::endian::big_uint32_buf_t u32_buf;
+
+  for (std::uint32_t field : {epoch, message_id, message_size, offset, size}) {
+    u32_buf = field;
+    out.insert(out.end(), u32_buf.data(), u32_buf.data() + sizeof(u32_buf));
+  }
+}
+
+void chunk_header::deserialize(const std::uint8_t* in) {
+  boost::endian::big_uint32_buf_t u32_buf;
+  int idx = 0;
+
+  for (std::uint32_t* field :
+       {&epoch, &message_id, &message_size, &offset, &size}) {
+    std::memcpy(u32_buf.data(), in + idx, sizeof(u32_buf));
+    *field = u32_buf.value();
+    idx += sizeof(u32_buf);
+  }
+}
+
+void probe::serialize(std::vector<std::uint8_t>& out) const {
+  boost::endian::big_uint64_buf_t u64_buf;
+
+  u64_buf = token;
+  out.insert(out.end(), u64_buf.data(), u64_buf.data() + sizeof(u64_buf));
+}
+
+void probe::deserialize(const std::uint8_t* in) {
+  boost::endian::big_uint64_buf_t u64_buf;
+
+  std::memcpy(u64_buf.data(), in, sizeof(u64_buf));
+  token = u64_buf.value();
+}
+
 }  // namespace ircom::packet
@@ -0,0 +1,179 @@
+#include "ircom/trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ircom::trace {
+
+namespace internal {
+
+std::atomic<bool> enabled = false;
+
+std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace internal
+
+namespace {
+
+// Written by its thread only. Kept after the thread exits, such that its
+// events are still written.
+struct thread_buffer {
+  explicit thread_buffer(long tid) : tid(tid) {}
+
+  const long tid;
+  // Allocated on the first recorded event, threads never recording cost
+  // nothing.
+  std::vector<internal::event> events;
+  // Number of events ever recorded since the last `start`.
+  std::atomic<std::uint64_t> head = 0;
+  // Set while recording, such that `stop` can wait for it.
+  std::atomic<bool> recording = false;
+  // Guarded by `registry_mtx`.
+  std::string name;
+};
+
+std::mutex registry_mtx;
+std::vector<std::shared_ptr<thread_buffer>> registry;
+
+thread_buffer& local_buffer() {
+  thread_local std::shared_ptr<thread_buffer> buf;
+  if (!buf) {
+    buf = std::make_shared<thread_buffer>(::syscall(SYS_gettid));
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    registry.push_back(buf);
+  }
+  return *buf;
+}
+
+void pause_unlocked() {
+  internal::enabled = false;
+  for (const std::shared_ptr<thread_buffer>& buf : registry) {
+    while (buf->recording) std::this_thread::yield();
+  }
+}
+
+void write_json_string(std::ostream& out, const char* str) {
+  out << '"';
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      out << '\\' << *str;
+    } else if (static_cast<unsigned char>(*str) < 0x20) {
+      char escaped[7];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", *str);
+      out << escaped;
+    } else {
+      out << *str;
+    }
+  }
+  out << '"';
+}
+
+// In microseconds, as expected by the format.
+void write_json_time(std::ostream& out, std::int64_t ns) {
+  char str[32];
+  std::snprintf(str, sizeof(str), "%lld.%03lld",
+                static_cast<long long>(ns / 1000),
+                static_cast<long long>(ns % 1000));
+  out << str;
+}
+
+}  // namespace
+
+namespace internal {
+
+void record(const event& ev) {
+  thread_buffer& buf = local_buffer();
+  // Pairs with `pause_unlocked`: either it sees this flag and waits, or this
+  // sees tracing disabled.
+  buf.recording = true;
+  if (enabled) {
+    if (buf.events.empty()) buf.events.resize(THREAD_BUFFER_CAP);
+    std::uint64_t head = buf.head.load(std::memory_order_relaxed);
+    buf.events[head % THREAD_BUFFER_CAP] = ev;
+    buf.head.store(head + 1, std::memory_order_release);
+  }
+  buf.recording.store(false, std::memory_order_release);
+}
+
+}  // namespace internal
+
+void start() {
+  std::lock_guard<std::mutex> lock(registry_mtx);
+  if (internal::enabled) return;
+  for (const std::shared_ptr<thread_buffer>& buf : registry) buf->head = 0;
+  internal::enabled = true;
+}
+
+void stop() {
+  std::lock_guard<std::mutex> lock(registry_mtx);
+  pause_unlocked();
+}
+
+void write_chrome_json(std::ostream& out) {
+  std::lock_guard<std::mutex> lock(registry_mtx);
+  bool was_enabled = internal::enabled;
+  pause_unlocked();
+
+  long pid = ::getpid();
+  const char* separator = "";
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  for (const std::shared_ptr<thread_buffer>& buf : registry) {
+    if (!buf->name.empty()) {
+      out << separator << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":"
+          << pid << ",\"tid\":" << buf->tid << ",\"args\":{\"name\":";
+      write_json_string(out, buf->name.c_str());
+      out << "}}";
+      separator = ",";
+    }
+
+    std::uint64_t head = buf->head.load(std::memory_order_acquire);
+    std::uint64_t begin = head > THREAD_BUFFER_CAP ? head - THREAD_BUFFER_CAP
+                                                   : 0;
+    for (std::uint64_t i = begin; i < head; ++i) {
+      const internal::event& ev = buf->events[i % THREAD_BUFFER_CAP];
+      out << separator << "\n{\"ph\":\"" << (ev.duration_ns < 0 ? 'i' : 'X')
+          << "\",\"cat\":";
+      write_json_string(out, ev.category);
+      out << ",\"name\":";
+      write_json_string(out, ev.name);
+      out << ",\"pid\":" << pid << ",\"tid\":" << buf->tid << ",\"ts\":";
+      write_json_time(out, ev.start_ns);
+      if (ev.duration_ns < 0) {
+        out << ",\"s\":\"t\"";
+      } else {
+        out << ",\"dur\":";
+        write_json_time(out, ev.duration_ns);
+      }
+      if (ev.arg_name) {
+        out << ",\"args\":{";
+        write_json_string(out, ev.arg_name);
+        out << ":" << ev.arg << "}";
+      }
+      out << "}";
+      separator = ",";
+    }
+  }
+  out << "\n]}\n";
+
+  internal::enabled = was_enabled;
+}
+
+void set_thread_name(const char* name) {
+  thread_buffer& buf = local_buffer();
+  std::lock_guard<std::mutex> lock(registry_mtx);
+  buf.name = name;
+}
+
+}  // namespace ircom::trace